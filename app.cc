@@ -0,0 +1,391 @@
+#include "app.h"
+#include "sphere.h"
+#include "material.h"
+#include "random.h"
+#include "trayracer.h"
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+#include "stb_image_write.h"
+
+//------------------------------------------------------------------------------
+/**
+*/
+bool
+ParseOptions(int argc, char* argv[], AppOptions& options)
+{
+    for (int i = 0; i + 1 < argc; i++) {
+        if (strcmp(argv[i], "-w") == 0) {
+            options.Width = std::stoi(argv[i + 1]);
+            std::cout << "width: " << options.Width << std::endl;
+        }
+        else if (strcmp(argv[i], "-h") == 0) {
+            options.Height = std::stoi(argv[i + 1]);
+            std::cout << "height: " << options.Height << std::endl;
+        }
+        else if (strcmp(argv[i], "-rpp") == 0) {
+            options.RaysPerPixel = std::stoi(argv[i + 1]);
+            std::cout << "ray per pixel: " << options.RaysPerPixel << std::endl;
+        }
+        else if (strcmp(argv[i], "-s") == 0) {
+            options.SphereAmount = std::stoi(argv[i + 1]);
+            std::cout << "SphereAmount: " << options.SphereAmount << std::endl;
+        }
+        else if (strcmp(argv[i], "-b") == 0) {
+            options.MaxBounces = std::stoi(argv[i + 1]);
+            std::cout << "MaxBounce: " << options.MaxBounces << std::endl;
+        }
+        else if (strcmp(argv[i], "-bins") == 0) {
+            options.BuildSettings.BinCount = std::stoi(argv[i + 1]);
+            if (options.BuildSettings.BinCount < 2) {
+                std::cout << "-bins needs at least 2 bins, got " << argv[i + 1] << std::endl;
+                return false;
+            }
+            std::cout << "SAH Bins: " << options.BuildSettings.BinCount << std::endl;
+        }
+        else if (strcmp(argv[i], "-bvh") == 0) {
+            options.BVHWidth = std::stoi(argv[i + 1]);
+            if (options.BVHWidth != 2 && options.BVHWidth != 4 && options.BVHWidth != 8) {
+                std::cout << "-bvh takes 2, 4 or 8, got " << argv[i + 1] << std::endl;
+                return false;
+            }
+            std::cout << "BVH Width: " << options.BVHWidth << std::endl;
+        }
+        else if (strcmp(argv[i], "-leaf") == 0) {
+            options.BuildSettings.MaxLeafSize = std::stoi(argv[i + 1]);
+            std::cout << "Max Leaf Size: " << options.BuildSettings.MaxLeafSize << std::endl;
+        }
+        else if (strcmp(argv[i], "-split") == 0) {
+            options.BuildSettings.SplitMode = strcmp(argv[i + 1], "spatial") == 0 ? BVHSplitMode::Spatial : BVHSplitMode::Object;
+            std::cout << "Split Mode: " << argv[i + 1] << std::endl;
+        }
+        else if (strcmp(argv[i], "-builder") == 0) {
+            options.BuildSettings.Builder = strcmp(argv[i + 1], "lbvh") == 0 ? BVHBuilder::LBVH : BVHBuilder::SAH;
+            std::cout << "BVH Builder: " << argv[i + 1] << std::endl;
+        }
+        else if (strcmp(argv[i], "-cache") == 0) {
+            options.CacheDir = argv[i + 1];
+            std::cout << "BVH Cache: " << options.CacheDir << std::endl;
+        }
+        else if (strcmp(argv[i], "-frames") == 0) {
+            options.Frames = std::max(std::stoi(argv[i + 1]), 1);
+            std::cout << "Frames: " << options.Frames << std::endl;
+        }
+        else if (strcmp(argv[i], "-threads") == 0) {
+            options.Threads = std::stoi(argv[i + 1]);
+            std::cout << "Threads: " << options.Threads << std::endl;
+        }
+        else if (strcmp(argv[i], "-seed") == 0) {
+            options.Seed = (uint32_t)std::stoul(argv[i + 1]);
+            std::cout << "Seed: " << options.Seed << std::endl;
+        }
+        else if (strcmp(argv[i], "-tile") == 0) {
+            options.TileSize = std::stoi(argv[i + 1]);
+            std::cout << "Tile Size: " << options.TileSize << std::endl;
+        }
+        else if (strcmp(argv[i], "-tile-order") == 0) {
+            if (strcmp(argv[i + 1], "scanline") == 0)
+                options.TileOrdering = TileOrder::Scanline;
+            else if (strcmp(argv[i + 1], "morton") == 0)
+                options.TileOrdering = TileOrder::Morton;
+            else
+                options.TileOrdering = TileOrder::Hilbert;
+            std::cout << "Tile Order: " << argv[i + 1] << std::endl;
+        }
+        else if (strcmp(argv[i], "-trace") == 0) {
+            options.Trace = argv[i + 1];
+            std::cout << "Trace: " << options.Trace << std::endl;
+        }
+        else if (strcmp(argv[i], "-heatmap") == 0) {
+            options.Heatmap = argv[i + 1];
+            std::cout << "Heatmap: " << options.Heatmap << std::endl;
+        }
+        else if (strcmp(argv[i], "-o") == 0) {
+            options.Output = argv[i + 1];
+            std::cout << "Output: " << options.Output << std::endl;
+        }
+    }
+    // FLAGS WITHOUT A VALUE, THEY CAN BE THE LAST ARGUMENT
+    for (int i = 0; i < argc; i++) {
+        if (strcmp(argv[i], "-headless") == 0)
+            options.bHeadless = true;
+        else if (strcmp(argv[i], "-perf-counters") == 0 || strcmp(argv[i], "--perf-counters") == 0)
+            options.bPerfCounters = true;
+    }
+    return true;
+}
+
+//------------------------------------------------------------------------------
+/**
+*/
+std::vector<Sphere*>
+CreateSpheres(int SphereAmount)
+{
+    Material* mat = new Material();
+    mat->type = "Lambertian";
+    mat->color = { 0.5,0.5,0.5 };
+    mat->roughness = 0.3;
+    Sphere* ground = new Sphere(1000, { 0,-1000, -1 }, mat);
+    std::vector<Sphere*> Spheres;
+    Spheres.push_back(ground);
+
+    std::vector<std::string>MaterialType;
+    std::vector<float> SpanVec;
+    MaterialType = { "Lambertian", "Conductor", "Dielectric"};
+    SpanVec = { 10.0f, 30.0f, 25.0f };
+    for (int it = 0; it < SphereAmount; it++)
+    {
+        Material* mat = new Material();
+        mat->type = MaterialType[it % 3];
+        float r = RandomFloat();
+        float g = RandomFloat();
+        float b = RandomFloat();
+        mat->color = { r,g,b };
+        mat->roughness = RandomFloat();
+        Sphere* ground = new Sphere(
+        RandomFloat() * 0.7f + 0.2f,
+        {
+            RandomFloatNTP() * SpanVec[it % 3],
+            RandomFloat() * SpanVec[it % 3] + 0.2f,
+            RandomFloatNTP() * SpanVec[it % 3]
+        },
+        mat);
+        Spheres.push_back(ground);
+    }
+    return Spheres;
+}
+
+//------------------------------------------------------------------------------
+/**
+*/
+std::vector<Sphere*>
+CreateScene(Raytracer& rt, const AppOptions& options)
+{
+    std::vector<Sphere*> Spheres = CreateSpheres(options.SphereAmount);
+    for (Sphere* sphere : Spheres)
+        rt.AddObject(sphere);
+    return Spheres;
+}
+
+//------------------------------------------------------------------------------
+/**
+*/
+void
+SetUpBVH(Raytracer& rt, const AppOptions& options, std::vector<Sphere*>& spheres)
+{
+    BoundingBox Box;
+    rt.BuildSettings = options.BuildSettings;
+    rt.BVHCacheDir = options.CacheDir;
+    rt.BVHWidth = options.BVHWidth;
+    rt.bPerfCounters = options.bPerfCounters;
+    rt.TileSize = options.TileSize;
+    rt.TileOrdering = options.TileOrdering;
+    rt.Seed = options.Seed;
+    rt.SetUpNode(Box, spheres);
+}
+
+//------------------------------------------------------------------------------
+/**
+*/
+void
+ResolveFramebuffer(const std::vector<Color>& framebuffer, int frameCount,
+                   std::vector<Color>& out, std::vector<uint8_t>* image)
+{
+    TRAYRACER_PROFILE_SCOPE("Resolve");
+    out.resize(framebuffer.size());
+    if (image) {
+        image->clear();
+        image->reserve(framebuffer.size() * 3);
+    }
+    size_t p = 0;
+    for (Color const& pixel : framebuffer)
+    {
+        out[p] = pixel;
+        out[p].r /= frameCount;
+        out[p].g /= frameCount;
+        out[p].b /= frameCount;
+        if (image) {
+            // BRIGHT SAMPLES GO PAST 1, CLAMP BEFORE THEY WRAP AROUND TO BLACK
+            image->push_back((uint8_t)(255 * std::min(std::max(out[p].r, 0.0f), 1.0f)));
+            image->push_back((uint8_t)(255 * std::min(std::max(out[p].g, 0.0f), 1.0f)));
+            image->push_back((uint8_t)(255 * std::min(std::max(out[p].b, 0.0f), 1.0f)));
+        }
+        p++;
+    }
+}
+
+//------------------------------------------------------------------------------
+/**
+*/
+bool
+WriteImage(const std::string& path, unsigned width, unsigned height, const std::vector<uint8_t>& image)
+{
+    TRAYRACER_PROFILE_SCOPE("ImageWrite");
+    // ROW 0 OF THE FRAMEBUFFER IS THE BOTTOM OF THE IMAGE
+    stbi_flip_vertically_on_write(1);
+
+    std::string Extension = path.substr(std::min(path.find_last_of('.'), path.size()));
+    std::transform(Extension.begin(), Extension.end(), Extension.begin(), ::tolower);
+    if (Extension == ".jpg" || Extension == ".jpeg")
+        return stbi_write_jpg(path.c_str(), width, height, 3, image.data(), 95) != 0;
+    if (Extension == ".bmp")
+        return stbi_write_bmp(path.c_str(), width, height, 3, image.data()) != 0;
+    if (Extension == ".tga")
+        return stbi_write_tga(path.c_str(), width, height, 3, image.data()) != 0;
+    return stbi_write_png(path.c_str(), width, height, 3, image.data(), width * 3) != 0;
+}
+
+//------------------------------------------------------------------------------
+/**
+*/
+void
+PrintReport(const Raytracer& rt, const AppOptions& options, float frameDuration)
+{
+    std::cout << "Width: " << options.Width << std::endl;
+    std::cout << "Height: " << options.Height << std::endl;
+    std::cout << "Ray Per Pixel: " << options.RaysPerPixel << std::endl;
+    std::cout << "Sphere Amount: " << options.SphereAmount << std::endl;
+    std::cout << "BVH Width: " << rt.BVHWidth << std::endl;
+    std::cout << "Tiles: " << rt.Tiles.size() << " of " << rt.TilesBuiltSize << "x" << rt.TilesBuiltSize << std::endl;
+    std::cout << "BVH Loaded From Cache: " << (rt.bBVHFromCache ? "yes" : "no") << std::endl;
+    std::cout << "BVH References: " << rt.Flat.PrimIndices.size() << " (" << rt.Flat.DuplicationFactor() << " per sphere)" << std::endl;
+    std::cout << "Duration: " << frameDuration << " sec" << std::endl;
+    rt.PrintRayStats(frameDuration);
+    rt.PrintTraversalStats();
+    rt.PrintPerfCounters();
+    std::cout << std::endl;
+}
+
+#if TRAYRACER_STATS
+//------------------------------------------------------------------------------
+/**
+    Maps 0..1 onto black, blue, cyan, green, yellow, red, white
+*/
+static void
+HeatColor(float t, uint8_t rgb[3])
+{
+    static const float Stops[][3] = {
+        { 0, 0, 0 }, { 0, 0, 1 }, { 0, 1, 1 }, { 0, 1, 0 }, { 1, 1, 0 }, { 1, 0, 0 }, { 1, 1, 1 }
+    };
+    const int NumStops = sizeof(Stops) / sizeof(Stops[0]);
+    float pos = std::min(std::max(t, 0.0f), 1.0f) * (NumStops - 1);
+    int i = std::min((int)pos, NumStops - 2);
+    float f = pos - i;
+    for (int k = 0; k < 3; k++)
+        rgb[k] = (uint8_t)(255 * (Stops[i][k] * (1 - f) + Stops[i + 1][k] * f));
+}
+#endif
+
+//------------------------------------------------------------------------------
+/**
+*/
+bool
+WriteHeatmap([[maybe_unused]] const Raytracer& rt, [[maybe_unused]] const std::string& path)
+{
+#if TRAYRACER_STATS
+    // COST OF A PIXEL IS EVERY BOX AND SPHERE TEST ITS SAMPLES MADE
+    std::vector<float> Cost(rt.PixelStats.size());
+    for (size_t i = 0; i < Cost.size(); i++)
+        Cost[i] = (float)rt.PixelStats[i].BoxTests + (float)rt.PixelStats[i].SphereTests;
+
+    // SCALE TO THE 99TH PERCENTILE SO A FEW EXTREME PIXELS DON'T FLATTEN THE REST
+    std::vector<float> Sorted = Cost;
+    size_t Rank = Sorted.empty() ? 0 : (Sorted.size() - 1) * 99 / 100;
+    std::nth_element(Sorted.begin(), Sorted.begin() + Rank, Sorted.end());
+    float Scale = Sorted.empty() ? 0.0f : Sorted[Rank];
+    Scale = Scale > 0 ? 1.0f / Scale : 0.0f;
+
+    std::vector<uint8_t> Image(Cost.size() * 3);
+    for (size_t i = 0; i < Cost.size(); i++)
+        HeatColor(Cost[i] * Scale, &Image[i * 3]);
+    std::cout << "Heatmap Scale: white is " << (Scale > 0 ? 1.0f / Scale : 0.0f) << " tests per pixel" << std::endl;
+    return WriteImage(path, rt.width, rt.height, Image);
+#else
+    std::cout << "Heatmaps need a build configured with -DTRAYRACER_STATS=ON" << std::endl;
+    return false;
+#endif
+}
+
+//------------------------------------------------------------------------------
+/**
+*/
+void
+StartTrace(const AppOptions& options)
+{
+    if (options.Trace.empty())
+        return;
+    Profiler::SetThreadName("Main");
+    Profiler::Enable(true);
+}
+
+//------------------------------------------------------------------------------
+/**
+*/
+void
+FinishTrace(const AppOptions& options)
+{
+    if (options.Trace.empty())
+        return;
+    Profiler::Enable(false);
+    if (Profiler::WriteChromeTrace(options.Trace))
+        std::cout << "Wrote " << options.Trace << std::endl;
+    else
+        std::cout << "Could not write " << options.Trace << std::endl;
+}
+
+//------------------------------------------------------------------------------
+/**
+*/
+int
+RunHeadless(const AppOptions& options)
+{
+    StartTrace(options);
+    std::vector<Color> framebuffer;
+    framebuffer.resize(options.Width * options.Height);
+
+    Raytracer rt = Raytracer(options.Width, options.Height, framebuffer, options.RaysPerPixel, options.MaxBounces, options.Threads);
+    std::vector<Sphere*> Spheres = CreateScene(rt, options);
+    SetUpBVH(rt, options, Spheres);
+
+    // SAME CAMERA THE VIEWER STARTS WITH
+    mat4 cameraTransform = multiply(rotationy(0), rotationx(0));
+    cameraTransform.m30 = 0;
+    cameraTransform.m31 = 1.0f;
+    cameraTransform.m32 = 10.0f;
+    rt.SetViewMatrix(cameraTransform);
+
+    float TotalDuration = 0;
+    for (int frame = 0; frame < options.Frames; frame++) {
+        auto start = std::chrono::high_resolution_clock::now();
+        rt.AssignJob();
+        auto end = std::chrono::high_resolution_clock::now();
+        std::chrono::duration<float> frameDuration = end - start;
+        TotalDuration += frameDuration.count();
+        std::cout << "Frame " << frame + 1 << "/" << options.Frames << ": " << frameDuration.count() << " sec" << std::endl;
+    }
+
+    std::vector<Color> resolved;
+    std::vector<uint8_t> ImageData;
+    ResolveFramebuffer(framebuffer, options.Frames, resolved, &ImageData);
+
+    PrintReport(rt, options, TotalDuration / options.Frames);
+    // SAME SCENE, SEED AND SETTINGS GIVE THE SAME HASH AT ANY THREAD COUNT
+    std::cout << "Image Hash: " << std::hex << std::setw(16) << std::setfill('0')
+              << Trayracer::HashImage((const float*)framebuffer.data(), options.Width, options.Height)
+              << std::dec << std::setfill(' ') << std::endl;
+
+    if (!WriteImage(options.Output, options.Width, options.Height, ImageData)) {
+        std::cout << "Could not write " << options.Output << std::endl;
+        return 1;
+    }
+    std::cout << "Wrote " << options.Output << std::endl;
+
+    if (!options.Heatmap.empty() && WriteHeatmap(rt, options.Heatmap))
+        std::cout << "Wrote " << options.Heatmap << std::endl;
+    FinishTrace(options);
+    return 0;
+}
@@ -0,0 +1,78 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <cstdint>
+#include "raytracer.h"
+
+//------------------------------------------------------------------------------
+/**
+    Command line, scene and image output shared by the interactive viewer
+    (main.cc) and the headless batch renderer (headless.cc). Nothing in here
+    touches GLFW or GL.
+*/
+
+struct AppOptions
+{
+    unsigned Width = 1500;
+    unsigned Height = 1500;
+    int RaysPerPixel = 1;
+    int SphereAmount = 256;
+    int MaxBounces = 5;
+    // worker threads, 0 uses one per hardware thread
+    unsigned Threads = 0;
+    int BVHWidth = 2;
+    BVHBuildSettings BuildSettings;
+    std::string CacheDir;
+
+    // render without a window and write Output once Frames frames are accumulated
+    bool bHeadless = false;
+    int Frames = 1;
+    std::string Output = "Frame.png";
+    // false colour image of the traversal cost of every pixel in the last frame, written on exit. Needs TRAYRACER_STATS
+    std::string Heatmap;
+    // Chrome trace_event JSON of the worker timeline, written on exit
+    std::string Trace;
+    // 0 picks the tile size from the image size and thread count
+    unsigned TileSize = 0;
+    TileOrder TileOrdering = TileOrder::Hilbert;
+    // seed of the render samples, the image only changes with the seed and the scene
+    uint32_t Seed = 0;
+    // hardware counters around every frame, Linux only
+    bool bPerfCounters = false;
+};
+
+/// parse the command line, unknown arguments are ignored. Returns false after
+/// printing why if a value is out of range
+bool ParseOptions(int argc, char* argv[], AppOptions& options);
+
+/// create the ground and SphereAmount random spheres, each with its own material
+std::vector<Sphere*> CreateSpheres(int SphereAmount);
+
+/// add the ground and options.SphereAmount random spheres to the raytracer
+std::vector<Sphere*> CreateScene(Raytracer& rt, const AppOptions& options);
+
+/// apply the BVH, tile and counter options and build the BVH over spheres
+void SetUpBVH(Raytracer& rt, const AppOptions& options, std::vector<Sphere*>& spheres);
+
+/// divide the accumulated framebuffer by the frame count into out, and
+/// convert it into 8 bit rgb for image output if image is given
+void ResolveFramebuffer(const std::vector<Color>& framebuffer, int frameCount,
+                        std::vector<Color>& out, std::vector<uint8_t>* image);
+
+/// write 8 bit rgb data as a png, or a jpg/bmp/tga depending on the extension of path
+bool WriteImage(const std::string& path, unsigned width, unsigned height, const std::vector<uint8_t>& image);
+
+/// write the traversal cost of every pixel of the last frame as a false colour image
+bool WriteHeatmap(const Raytracer& rt, const std::string& path);
+
+/// print the settings and timing of a render
+void PrintReport(const Raytracer& rt, const AppOptions& options, float frameDuration);
+
+/// start recording the profiler timeline if options.Trace is set
+void StartTrace(const AppOptions& options);
+
+/// stop recording and write options.Trace
+void FinishTrace(const AppOptions& options);
+
+/// render options.Frames frames into a plain framebuffer and write the image, returns the exit code
+int RunHeadless(const AppOptions& options);
@@ -0,0 +1,323 @@
+#include "trayracer.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+//------------------------------------------------------------------------------
+/**
+    Benchmark suite. Runs a fixed matrix of scenes through trayracer_core and
+    reports rays (camera rays plus bounces) per second, so numbers from
+    different builds can be compared directly.
+
+    The matrix sweeps one axis at a time around a baseline case instead of
+    running every combination, which would take hours at 1M spheres and 64 rpp.
+*/
+
+struct BenchCase
+{
+    std::string Name;
+    int Spheres;
+    unsigned Width;
+    unsigned Height;
+    unsigned RaysPerPixel;
+    unsigned MaxBounces;
+};
+
+struct BenchResult
+{
+    BenchCase Case;
+    double BuildSeconds = 0;
+    double MedianSeconds = 0;
+    double P95Seconds = 0;
+    double MinSeconds = 0;
+    // rays per second, camera rays plus bounces, at the median and the 95th percentile frame time
+    double MedianRaysPerSecond = 0;
+    double P95RaysPerSecond = 0;
+    // hash of the first frame, the same on every machine that rendered the same image
+    uint64_t ImageHash = 0;
+};
+
+// ONE SEED FOR EVERY SCENE, A SPHERE COUNT ALWAYS MEANS THE SAME SPHERES
+static const uint32_t SceneSeed = 1337;
+
+//------------------------------------------------------------------------------
+/**
+*/
+static std::vector<BenchCase>
+MakeCases(bool quick, int maxSpheres)
+{
+    const BenchCase Baseline = { "", 4096, 640, 360, 4, 5 };
+    std::vector<BenchCase> Cases;
+    auto Add = [&](const char* axis, BenchCase c) {
+        if (c.Spheres > maxSpheres)
+            return;
+        std::ostringstream name;
+        name << axis << "/s" << c.Spheres << "_" << c.Width << "x" << c.Height << "_rpp" << c.RaysPerPixel << "_b" << c.MaxBounces;
+        c.Name = name.str();
+        Cases.push_back(c);
+    };
+
+    if (quick) {
+        BenchCase c = Baseline;
+        c.Width = 160; c.Height = 90; c.RaysPerPixel = 1;
+        for (int spheres : { 256, 4096 }) {
+            c.Spheres = spheres;
+            Add("quick", c);
+        }
+        return Cases;
+    }
+
+    for (int spheres : { 256, 4096, 65536, 1 << 20 }) {
+        BenchCase c = Baseline;
+        c.Spheres = spheres;
+        Add("spheres", c);
+    }
+    for (unsigned rpp : { 1u, 16u, 64u }) {
+        BenchCase c = Baseline;
+        c.RaysPerPixel = rpp;
+        Add("rpp", c);
+    }
+    for (unsigned bounces : { 1u, 16u }) {
+        BenchCase c = Baseline;
+        c.MaxBounces = bounces;
+        Add("bounces", c);
+    }
+    for (auto res : { std::make_pair(320u, 180u), std::make_pair(1280u, 720u), std::make_pair(1920u, 1080u) }) {
+        BenchCase c = Baseline;
+        c.Width = res.first;
+        c.Height = res.second;
+        c.RaysPerPixel = 1;
+        Add("resolution", c);
+    }
+    return Cases;
+}
+
+//------------------------------------------------------------------------------
+/**
+    Nearest rank percentile of already sorted values
+*/
+static double
+Percentile(const std::vector<double>& sorted, double p)
+{
+    size_t rank = (size_t)std::ceil(p * sorted.size());
+    return sorted[std::min(std::max(rank, (size_t)1), sorted.size()) - 1];
+}
+
+//------------------------------------------------------------------------------
+/**
+*/
+static BenchResult
+RunCase(const BenchCase& benchCase, const Trayracer::Scene& scene, const Trayracer::RenderSettings& base, int warmup, int reps)
+{
+    Trayracer::RenderSettings settings = base;
+    settings.Width = benchCase.Width;
+    settings.Height = benchCase.Height;
+    settings.RaysPerPixel = benchCase.RaysPerPixel;
+    settings.MaxBounces = benchCase.MaxBounces;
+
+    Trayracer::Renderer renderer(settings);
+    renderer.BuildAccelerationStructure(scene);
+    std::vector<float> image((size_t)settings.Width * settings.Height * 3);
+
+    // THE FIRST FRAME IS HASHED, SO THE HASH DOESN'T DEPEND ON -warmup AND -reps
+    uint64_t ImageHash = 0;
+    std::vector<double> Seconds;
+    uint64_t TimedRays = 0;
+    for (int i = 0; i < warmup + reps; i++) {
+        const Trayracer::RenderStats Before = renderer.GetStats();
+        renderer.RenderFrame(image.data());
+        if (i == 0)
+            ImageHash = Trayracer::HashImage(image.data(), settings.Width, settings.Height);
+        if (i >= warmup) {
+            const Trayracer::RenderStats After = renderer.GetStats();
+            Seconds.push_back(After.LastFrameSeconds);
+            TimedRays += (After.CameraRays + After.Bounces) - (Before.CameraRays + Before.Bounces);
+        }
+    }
+    std::sort(Seconds.begin(), Seconds.end());
+
+    // BOUNCES VARY A LITTLE FROM FRAME TO FRAME, SO THE AVERAGE OF THE TIMED ONES
+    const double RaysPerFrame = (double)TimedRays / Seconds.size();
+    BenchResult result;
+    result.Case = benchCase;
+    result.BuildSeconds = renderer.GetStats().BuildSeconds;
+    result.MedianSeconds = Percentile(Seconds, 0.5);
+    result.P95Seconds = Percentile(Seconds, 0.95);
+    result.MinSeconds = Seconds.front();
+    result.MedianRaysPerSecond = RaysPerFrame / result.MedianSeconds;
+    result.P95RaysPerSecond = RaysPerFrame / result.P95Seconds;
+    result.ImageHash = ImageHash;
+    return result;
+}
+
+//------------------------------------------------------------------------------
+/**
+*/
+static std::string
+CompilerName()
+{
+    std::ostringstream name;
+#if defined(__clang__)
+    name << "clang " << __clang_major__ << "." << __clang_minor__;
+#elif defined(__GNUC__)
+    name << "gcc " << __GNUC__ << "." << __GNUC_MINOR__;
+#elif defined(_MSC_VER)
+    name << "msvc " << _MSC_VER;
+#else
+    name << "unknown";
+#endif
+    return name.str();
+}
+
+//------------------------------------------------------------------------------
+/**
+*/
+static std::string
+HexHash(uint64_t hash)
+{
+    std::ostringstream hex;
+    hex << std::hex << std::setw(16) << std::setfill('0') << hash;
+    return hex.str();
+}
+
+//------------------------------------------------------------------------------
+/**
+*/
+static void
+WriteJson(const std::string& path, const std::vector<BenchResult>& results, const Trayracer::RenderSettings& settings, int warmup, int reps)
+{
+    std::ofstream out(path);
+    out << "{\n";
+    out << "  \"timestamp\": " << (long long)std::time(nullptr) << ",\n";
+    out << "  \"compiler\": \"" << CompilerName() << "\",\n";
+    out << "  \"threads\": " << (settings.Threads ? settings.Threads : std::thread::hardware_concurrency()) << ",\n";
+    out << "  \"bvh_width\": " << settings.BVHWidth << ",\n";
+    out << "  \"tile_size\": " << settings.TileSize << ",\n";
+    out << "  \"seed\": " << SceneSeed << ",\n";
+    out << "  \"render_seed\": " << settings.Seed << ",\n";
+    out << "  \"warmup\": " << warmup << ",\n";
+    out << "  \"reps\": " << reps << ",\n";
+    out << "  \"results\": [\n";
+    for (size_t i = 0; i < results.size(); i++) {
+        const BenchResult& r = results[i];
+        out << "    { \"name\": \"" << r.Case.Name << "\""
+            << ", \"spheres\": " << r.Case.Spheres
+            << ", \"width\": " << r.Case.Width
+            << ", \"height\": " << r.Case.Height
+            << ", \"rpp\": " << r.Case.RaysPerPixel
+            << ", \"bounces\": " << r.Case.MaxBounces
+            << ", \"build_s\": " << r.BuildSeconds
+            << ", \"median_s\": " << r.MedianSeconds
+            << ", \"p95_s\": " << r.P95Seconds
+            << ", \"min_s\": " << r.MinSeconds
+            << ", \"median_rays_per_s\": " << r.MedianRaysPerSecond
+            << ", \"p95_rays_per_s\": " << r.P95RaysPerSecond
+            << ", \"image_hash\": \"" << HexHash(r.ImageHash) << "\""
+            << " }" << (i + 1 < results.size() ? "," : "") << "\n";
+    }
+    out << "  ]\n";
+    out << "}\n";
+}
+
+//------------------------------------------------------------------------------
+/**
+*/
+static void
+WriteCsv(const std::string& path, const std::vector<BenchResult>& results)
+{
+    std::ofstream out(path);
+    out << "name,spheres,width,height,rpp,bounces,build_s,median_s,p95_s,min_s,median_rays_per_s,p95_rays_per_s,image_hash\n";
+    for (const BenchResult& r : results) {
+        out << r.Case.Name << "," << r.Case.Spheres << "," << r.Case.Width << "," << r.Case.Height << ","
+            << r.Case.RaysPerPixel << "," << r.Case.MaxBounces << "," << r.BuildSeconds << ","
+            << r.MedianSeconds << "," << r.P95Seconds << "," << r.MinSeconds << ","
+            << r.MedianRaysPerSecond << "," << r.P95RaysPerSecond << "," << HexHash(r.ImageHash) << "\n";
+    }
+}
+
+//------------------------------------------------------------------------------
+/**
+*/
+int main(int argc, char* argv[])
+{
+    Trayracer::RenderSettings settings;
+    int warmup = 1;
+    int reps = 5;
+    int maxSpheres = 1 << 20;
+    bool quick = false;
+    std::string jsonPath = "bench.json";
+    std::string csvPath;
+    std::string filter;
+
+    for (int i = 0; i < argc; i++) {
+        if (strcmp(argv[i], "-quick") == 0)
+            quick = true;
+        if (i + 1 >= argc)
+            continue;
+        if (strcmp(argv[i], "-warmup") == 0)
+            warmup = std::max(std::stoi(argv[i + 1]), 0);
+        else if (strcmp(argv[i], "-reps") == 0)
+            reps = std::max(std::stoi(argv[i + 1]), 1);
+        else if (strcmp(argv[i], "-threads") == 0)
+            settings.Threads = std::stoi(argv[i + 1]);
+        else if (strcmp(argv[i], "-seed") == 0)
+            settings.Seed = (uint32_t)std::stoul(argv[i + 1]);
+        else if (strcmp(argv[i], "-tile") == 0)
+            settings.TileSize = std::stoi(argv[i + 1]);
+        else if (strcmp(argv[i], "-bvh") == 0) {
+            settings.BVHWidth = std::stoi(argv[i + 1]);
+            if (settings.BVHWidth != 2 && settings.BVHWidth != 4 && settings.BVHWidth != 8) {
+                std::cout << "-bvh takes 2, 4 or 8, got " << argv[i + 1] << std::endl;
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "-max-spheres") == 0)
+            maxSpheres = std::stoi(argv[i + 1]);
+        else if (strcmp(argv[i], "-filter") == 0)
+            filter = argv[i + 1];
+        else if (strcmp(argv[i], "-json") == 0)
+            jsonPath = argv[i + 1];
+        else if (strcmp(argv[i], "-csv") == 0)
+            csvPath = argv[i + 1];
+    }
+
+    std::vector<BenchCase> Cases = MakeCases(quick, maxSpheres);
+    if (!filter.empty()) {
+        Cases.erase(std::remove_if(Cases.begin(), Cases.end(),
+            [&filter](const BenchCase& c) { return c.Name.find(filter) == std::string::npos; }), Cases.end());
+    }
+
+    // SCENES ARE GENERATED ONCE PER SPHERE COUNT AND SHARED BY ALL CASES USING THEM
+    std::map<int, std::unique_ptr<Trayracer::Scene>> Scenes;
+    std::vector<BenchResult> Results;
+    for (const BenchCase& c : Cases) {
+        std::unique_ptr<Trayracer::Scene>& scene = Scenes[c.Spheres];
+        if (!scene) {
+            scene.reset(new Trayracer::Scene());
+            scene->AddRandomSpheres(c.Spheres, SceneSeed);
+        }
+        BenchResult result = RunCase(c, *scene, settings, warmup, reps);
+        Results.push_back(result);
+        std::cout << c.Name
+                  << "  median " << result.MedianRaysPerSecond * 1e-6 << " Mrays/s"
+                  << "  p95 " << result.P95RaysPerSecond * 1e-6 << " Mrays/s"
+                  << "  (" << result.MedianSeconds << " s/frame, build " << result.BuildSeconds << " s)" << std::endl;
+    }
+
+    if (!jsonPath.empty())
+        WriteJson(jsonPath, Results, settings, warmup, reps);
+    if (!csvPath.empty())
+        WriteCsv(csvPath, Results);
+    return 0;
+}
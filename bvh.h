@@ -8,7 +8,11 @@
 #include <iostream>
 #include <vector>
 #include <cassert>
+#include <float.h>
 #include <stack>
+#include <unordered_map>
+#include <functional>
+#include <cstdint>
 
 
 class Node;
@@ -23,9 +27,10 @@ bool IsInVec(std::vector<T> vec, T target) {
 class BoundingBox 
 {
 public:
-	vec3 Min = vec3(0,0,0);
-	vec3 Max = vec3(0,0,0);
-	vec3 Center = (Min + Max) / 2;
+	// STARTS OUT EMPTY SO THE FIRST GROW SNAPS TO WHATEVER IS ADDED
+	vec3 Min = vec3(FLT_MAX, FLT_MAX, FLT_MAX);
+	vec3 Max = vec3(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+	vec3 Center = vec3(0, 0, 0);
 
 	// Make the bouding box include the sphere that we pass in
 	void GrowToInclude(Sphere* sphere) {
@@ -40,6 +45,18 @@ public:
 		//this->bHasObject = true;
 	}
 
+	void GrowToInclude(const vec3& point) {
+		Min = min(Min, point);
+		Max = max(Max, point);
+		this->Center = (Min + Max) / 2;
+	}
+
+	void GrowToInclude(const BoundingBox& box) {
+		Min = min(Min, box.Min);
+		Max = max(Max, box.Max);
+		this->Center = (Min + Max) / 2;
+	}
+
 	bool BoxIntersection(Ray ray, float maxDist) {
         float txMin = (this->Min.x - ray.Origin.x) * ray.InvRayDir.x;
         float txMax = (this->Max.x - ray.Origin.x) * ray.InvRayDir.x;
@@ -74,7 +91,9 @@ public:
 		return this->Max - this->Min;
 	}
 
-	float SurfaceArea() {
+	float SurfaceArea() const {
+		if (Max.x < Min.x)
+			return 0.0f;
 		float width = Max.x - Min.x;
 		float height = Max.y - Min.y;
 		float depth = Max.z - Min.z;
@@ -85,20 +104,144 @@ public:
 };
 
 
+// Deepest tree the fixed size traversal stacks can handle
+constexpr int BVHStackSize = 64;
+
+// How the builder deals with spheres that straddle a split plane
+enum class BVHSplitMode
+{
+	// partition spheres by centroid, every sphere is referenced exactly once
+	Object,
+	// SBVH: may also split space, straddling spheres are then referenced by
+	// both children with their bounds clipped to each side
+	Spatial
+};
+
+// Which algorithm builds the tree
+enum class BVHBuilder
+{
+	// top down binned SAH over a Node tree, best trees
+	SAH,
+	// Morton code sorted linear BVH written straight to FlatBVH, see lbvh.h
+	LBVH
+};
+
+// Settings controlling how the BVH is built
+struct BVHBuildSettings
+{
+	BVHBuilder Builder = BVHBuilder::SAH;
+
+	// number of bins per axis the SAH split search evaluates, at least 2
+	int BinCount = 16;
+	// leaves holding more spheres than this are split even if SAH disagrees
+	int MaxLeafSize = 8;
+	// SAH cost of visiting an inner node, relative to IntersectionCost
+	float TraversalCost = 1.0f;
+	// SAH cost of one Sphere::Intersect call
+	float IntersectionCost = 1.0f;
+	// only a safety net for degenerate input, SAH decides where to stop
+	int MaxDepth = BVHStackSize - 4;
+
+	BVHSplitMode SplitMode = BVHSplitMode::Object;
+	// spatial splits are only tried when the children of the best object
+	// split overlap by more than this fraction of the root surface area
+	float SpatialSplitAlpha = 1e-5f;
+	// total references may grow to this many times the sphere count
+	float MaxDuplication = 1.5f;
+
+	// with a task runner, nodes this small are built as one task each
+	int ParallelSubtreeSize = 4096;
+	// with a task runner, nodes at least this big are binned in parallel
+	int ParallelBinThreshold = 1 << 16;
+
+	// LBVH: 63 bit Morton codes (21 bits per axis) instead of 30 bit ones
+	bool bWideMortonCodes = false;
+	// LBVH: spheres sharing this many top code bits form one treelet
+	int TreeletBits = 12;
+	// LBVH: join the treelets with binned SAH instead of Morton splits
+	bool bTreeletSAH = true;
+};
+
+// Lets the builder hand work to a thread pool
+struct BVHTaskRunner
+{
+	// runs every task and returns once all of them are done, never called
+	// from inside one of the tasks
+	std::function<void(std::vector<std::function<void()>>&)> Run;
+	// how many tasks a data parallel loop gets cut into
+	int Workers = 1;
+};
+
+class Node;
+
+// A subtree the top levels handed off, the depth it starts at and the
+// duplicate references it may still add with spatial splits
+struct BVHSubtree
+{
+	Node* Root;
+	int Depth;
+	int Budget;
+};
+
+// Bookkeeping shared by every node of one build
+struct BVHBuildContext
+{
+	float RootArea = 0.0f;
+	// null when building on the calling thread only
+	const BVHTaskRunner* Runner = nullptr;
+	std::vector<BVHSubtree> Subtrees;
+};
+
+// One bin of the binned SAH split search
+struct Bin
+{
+	BoundingBox bounds;
+	int count = 0;
+	// spatial splits count where references start and end instead
+	int entries = 0;
+	int exits = 0;
+};
+
+
 class Node 
 {
 public:
 	BoundingBox bounds;
 	std::vector<Sphere*> spheres;
+	// bounds of each reference in spheres, clipped when a spatial split
+	// divided the sphere between several nodes
+	std::vector<BoundingBox> RefBounds;
 	Node* ChildA = nullptr;
 	Node* ChildB = nullptr;
+	// axis the node was split along, ChildA holds the lower half
+	int SplitAxis = 0;
 
 	Node() {};
 
-	Node(BoundingBox box, const std::vector<Sphere*> sp)
+	// Splits the top of the tree on the calling thread, binning big nodes
+	// in parallel, then builds every subtree small enough as its own task
+	Node(BoundingBox box, const std::vector<Sphere*> sp, const BVHBuildSettings& buildSettings = BVHBuildSettings(),
+		const BVHTaskRunner* runner = nullptr)
 	: bounds(box), spheres(sp) {
+		// FEWER THAN TWO BINS HAVE NO PLANE BETWEEN THEM, BinIndex WOULD RETURN -1
+		BVHBuildSettings settings = buildSettings;
+		settings.BinCount = std::max(settings.BinCount, 2);
 		Build(sp);
-		SplitNode(this, 0);
+		BVHBuildContext context;
+		context.RootArea = bounds.SurfaceArea();
+		context.Runner = runner;
+		int Budget = std::max((int)(sp.size() * settings.MaxDuplication) - (int)sp.size(), 0);
+		SplitNode(this, 0, Budget, settings, context, true);
+
+		if (context.Subtrees.empty())
+			return;
+		std::vector<std::function<void()>> tasks;
+		for (auto& subtree : context.Subtrees) {
+			tasks.push_back([this, subtree, &settings, &context]() {
+				SplitNode(subtree.Root, subtree.Depth, subtree.Budget, settings, context, false);
+			});
+		}
+		runner->Run(tasks);
 	}
 
 	~Node() {
@@ -107,14 +250,26 @@ public:
 	}
 
 	void AddSphere(Sphere* sphere) {
+		BoundingBox box;
+		box.GrowToInclude(sphere);
+		AddReference(sphere, box);
+	}
+
+	void AddReference(Sphere* sphere, const BoundingBox& box) {
 		spheres.push_back(sphere);
-        this->bounds.GrowToInclude(sphere);
+		RefBounds.push_back(box);
+		this->bounds.GrowToInclude(box);
 	}
 
 	// Build BVH
 	void Build(const std::vector<Sphere*> spheres) {
-		for (auto sphere : spheres) 
-			bounds.GrowToInclude(sphere);
+		RefBounds.clear();
+		for (auto sphere : spheres) {
+			BoundingBox box;
+			box.GrowToInclude(sphere);
+			RefBounds.push_back(box);
+			bounds.GrowToInclude(box);
+		}
 		return;
 	}
 
@@ -133,113 +288,503 @@ public:
 		return left + right + 1;
 	}
 
-	void FindBestSplit(Node* Root, int &SplitAxis, float &SplitPos) {
-		int Iter = 10000;
-		int CurrentBestResult = 2147483647;
-		float Candidate, Length;
-		float BestCadidate = FLT_MAX;
-		int Result;
-		for (int j = 0; j < 3; j++) {
-			float Scale = (this->bounds.Max[j] - this->bounds.Min[j]) / Iter;
-			Length = this->bounds.Max[j] - this->bounds.Min[j];
-			for (int i = 0; i < Iter; i++) {
-				Candidate = (Length / Iter) * i;
-				Result = EvaluateSplit(Root, j, Candidate);
-				if (Result < CurrentBestResult) {
-					SplitAxis = j;
-					SplitPos = Candidate;
-					CurrentBestResult = Result;
+	// Binned SAH: bins the reference centroids along each axis and sweeps the
+	// prefix/suffix bounds, returns the relative cost of the best split found
+	// and how much the two resulting children overlap
+	float FindBestSplit(Node* Root, int BinCount, int &SplitAxis, int &SplitBin, float &OverlapArea,
+		const BVHBuildSettings& settings, const BVHTaskRunner* runner) {
+		BoundingBox CentroidBounds;
+		for (auto& box : Root->RefBounds)
+			CentroidBounds.GrowToInclude(box.Center);
+		vec3 Extent = CentroidBounds.Size();
+
+		// BIN ALL THREE AXES IN ONE PASS OVER THE REFERENCES
+		std::vector<Bin> Bins = GatherBins(Root, 3 * BinCount, settings, runner, [&](size_t r, Bin* bins) {
+			const BoundingBox& box = Root->RefBounds[r];
+			for (int Axis = 0; Axis < 3; Axis++) {
+				if (Extent[Axis] <= 0.0f)
+					continue;
+				Bin& bin = bins[Axis * BinCount + BinIndex(box.Center[Axis], CentroidBounds.Min[Axis], Extent[Axis], BinCount)];
+				bin.bounds.GrowToInclude(box);
+				bin.count++;
+			}
+		});
+
+		std::vector<BoundingBox> LeftBox(BinCount), RightBox(BinCount);
+		std::vector<int> LeftCount(BinCount), RightCount(BinCount);
+		float BestCost = FLT_MAX;
+		SplitAxis = -1;
+		SplitBin = -1;
+		OverlapArea = 0.0f;
+
+		for (int Axis = 0; Axis < 3; Axis++) {
+			if (Extent[Axis] <= 0.0f)
+				continue;
+			const Bin* AxisBins = &Bins[Axis * BinCount];
+
+			// SWEEP FROM BOTH SIDES, ENTRY i HOLDS EVERYTHING LEFT/RIGHT OF PLANE i
+			BoundingBox Left, Right;
+			int LeftSum = 0, RightSum = 0;
+			for (int i = 1; i < BinCount; i++) {
+				Left.GrowToInclude(AxisBins[i - 1].bounds);
+				LeftSum += AxisBins[i - 1].count;
+				LeftBox[i] = Left;
+				LeftCount[i] = LeftSum;
+
+				Right.GrowToInclude(AxisBins[BinCount - i].bounds);
+				RightSum += AxisBins[BinCount - i].count;
+				RightBox[BinCount - i] = Right;
+				RightCount[BinCount - i] = RightSum;
+			}
+
+			for (int i = 1; i < BinCount; i++) {
+				if (LeftCount[i] == 0 || RightCount[i] == 0)
+					continue;
+				float Cost = LeftBox[i].SurfaceArea() * LeftCount[i] + RightBox[i].SurfaceArea() * RightCount[i];
+				if (Cost < BestCost) {
+					BestCost = Cost;
+					SplitAxis = Axis;
+					SplitBin = i;
+					OverlapArea = Overlap(LeftBox[i], RightBox[i]).SurfaceArea();
 				}
 			}
 		}
-	}	
-	
+
+		if (SplitAxis < 0)
+			return FLT_MAX;
+		return BestCost / Root->bounds.SurfaceArea();
+	}
+
+	// SBVH spatial split search: bins the references over the node bounds,
+	// clipping every reference to each bin it overlaps, returns the relative
+	// cost of the best plane found
+	float FindBestSpatialSplit(Node* Root, int BinCount, int &SplitAxis, float &SplitPos,
+		const BVHBuildSettings& settings, const BVHTaskRunner* runner) {
+		vec3 Lo = Root->bounds.Min;
+		vec3 Extent = Root->bounds.Size();
+		vec3 BinWidth = Extent / BinCount;
+
+		std::vector<Bin> Bins = GatherBins(Root, 3 * BinCount, settings, runner, [&](size_t r, Bin* bins) {
+			const BoundingBox& box = Root->RefBounds[r];
+			for (int Axis = 0; Axis < 3; Axis++) {
+				if (Extent[Axis] <= 0.0f)
+					continue;
+				Bin* AxisBins = bins + Axis * BinCount;
+				int First = BinIndex(box.Min[Axis], Lo[Axis], Extent[Axis], BinCount);
+				int Last = BinIndex(box.Max[Axis], Lo[Axis], Extent[Axis], BinCount);
+				for (int b = First; b <= Last; b++) {
+					float SlabMin = Lo[Axis] + BinWidth[Axis] * b;
+					float SlabMax = (b == BinCount - 1) ? (float)Root->bounds.Max[Axis] : SlabMin + BinWidth[Axis];
+					AxisBins[b].bounds.GrowToInclude(ClipReference(Root->spheres[r], box, Axis, SlabMin, SlabMax));
+				}
+				AxisBins[First].entries++;
+				AxisBins[Last].exits++;
+			}
+		});
+
+		std::vector<float> LeftArea(BinCount), RightArea(BinCount);
+		std::vector<int> LeftCount(BinCount), RightCount(BinCount);
+		float BestCost = FLT_MAX;
+		SplitAxis = -1;
+
+		for (int Axis = 0; Axis < 3; Axis++) {
+			if (Extent[Axis] <= 0.0f)
+				continue;
+			const Bin* AxisBins = &Bins[Axis * BinCount];
+
+			BoundingBox Left, Right;
+			int LeftSum = 0, RightSum = 0;
+			for (int i = 1; i < BinCount; i++) {
+				Left.GrowToInclude(AxisBins[i - 1].bounds);
+				LeftSum += AxisBins[i - 1].entries;
+				LeftArea[i] = Left.SurfaceArea();
+				LeftCount[i] = LeftSum;
+
+				Right.GrowToInclude(AxisBins[BinCount - i].bounds);
+				RightSum += AxisBins[BinCount - i].exits;
+				RightArea[BinCount - i] = Right.SurfaceArea();
+				RightCount[BinCount - i] = RightSum;
+			}
+
+			for (int i = 1; i < BinCount; i++) {
+				if (LeftCount[i] == 0 || RightCount[i] == 0)
+					continue;
+				float Cost = LeftArea[i] * LeftCount[i] + RightArea[i] * RightCount[i];
+				if (Cost < BestCost) {
+					BestCost = Cost;
+					SplitAxis = Axis;
+					SplitPos = Lo[Axis] + BinWidth[Axis] * i;
+				}
+			}
+		}
+
+		if (SplitAxis < 0)
+			return FLT_MAX;
+		return BestCost / Root->bounds.SurfaceArea();
+	}
+
+	// Runs BinOne over every reference of the node into NumBins bins. Big
+	// nodes are cut into one range per worker, each filling its own bins,
+	// which are merged in order afterwards
+	template<typename F>
+	std::vector<Bin> GatherBins(Node* Root, int NumBins, const BVHBuildSettings& settings,
+		const BVHTaskRunner* runner, F BinOne) {
+		size_t Count = Root->spheres.size();
+		int Chunks = 1;
+		if (runner && runner->Workers > 1 && Count >= (size_t)settings.ParallelBinThreshold)
+			Chunks = runner->Workers;
+
+		std::vector<std::vector<Bin>> Local(Chunks, std::vector<Bin>(NumBins));
+		if (Chunks == 1) {
+			for (size_t r = 0; r < Count; r++)
+				BinOne(r, Local[0].data());
+			return std::move(Local[0]);
+		}
+
+		std::vector<std::function<void()>> tasks;
+		for (int c = 0; c < Chunks; c++) {
+			tasks.push_back([&, c]() {
+				size_t Begin = Count * c / Chunks;
+				size_t End = Count * (c + 1) / Chunks;
+				for (size_t r = Begin; r < End; r++)
+					BinOne(r, Local[c].data());
+			});
+		}
+		runner->Run(tasks);
+
+		for (int c = 1; c < Chunks; c++) {
+			for (int b = 0; b < NumBins; b++) {
+				Local[0][b].bounds.GrowToInclude(Local[c][b].bounds);
+				Local[0][b].count += Local[c][b].count;
+				Local[0][b].entries += Local[c][b].entries;
+				Local[0][b].exits += Local[c][b].exits;
+			}
+		}
+		return std::move(Local[0]);
+	}
+
 	void NormalSplit(Node* Root, int &SplitAxis, float &SplitPos) {
 		vec3 size = Root->bounds.Size();
 		SplitAxis = size.x > max(size.y, size.z) ? 0 : size.y > size.z ? 1 : 2;
 		SplitPos = Root->bounds.Center[SplitAxis];
 	}
 
-	float EvaluateSplit(Node* RootAxis, int Axis, float Pos) {
-		Node ASpheres;
-		Node BSpheres;
-		unsigned int OverlappedCount = 0;
+	// bTopLevel is only set while the calling thread walks the top of the
+	// tree, it hands smaller subtrees to the task runner instead of recursing.
+	// Budget is how many duplicate references spatial splits may still add below parent
+	void SplitNode(Node* parent, int depth, int Budget, const BVHBuildSettings& settings, BVHBuildContext& context, bool bTopLevel) {
+		int Count = (int)parent->spheres.size();
+		const BVHTaskRunner* runner = bTopLevel ? context.Runner : nullptr;
+		if (runner && Count <= settings.ParallelSubtreeSize) {
+			context.Subtrees.push_back({ parent, depth, Budget });
+			return;
+		}
+		if (depth >= settings.MaxDepth || Count <= 1) {
+			return;
+		}
 
-		for (auto sphere : RootAxis->spheres) {
-			if (bInA(sphere, Axis, Pos)) {
-				ASpheres.AddSphere(sphere);
-			}
-			else if (bInB(sphere, Axis, Pos)) {
-				BSpheres.AddSphere(sphere);
+		int SplitAxis, SplitBin;
+		float OverlapArea;
+		float RelativeCost = FindBestSplit(parent, settings.BinCount, SplitAxis, SplitBin, OverlapArea, settings, runner);
+
+		// ONLY BOTHER WITH SPATIAL SPLITS WHERE OBJECT SPLITS LEAVE OVERLAP
+		int SpatialAxis = -1;
+		float SpatialPos = 0.0f;
+		float SpatialCost = FLT_MAX;
+		if (settings.SplitMode == BVHSplitMode::Spatial && Budget > 0
+			&& OverlapArea >= settings.SpatialSplitAlpha * context.RootArea) {
+			SpatialCost = FindBestSpatialSplit(parent, settings.BinCount, SpatialAxis, SpatialPos, settings, runner);
+		}
+
+		float BestCost = std::min(RelativeCost, SpatialCost);
+		if (BestCost == FLT_MAX) {
+			// ALL CENTROIDS COINCIDE, NOTHING TO GAIN FROM SPLITTING
+			return;
+		}
+
+		// SURFACE AREA HEURISTIC: ONLY SPLIT WHEN IT IS CHEAPER THAN TESTING
+		// EVERY SPHERE, OR WHEN THE LEAF WOULD GET TOO BIG
+		float SplitCost = settings.TraversalCost + settings.IntersectionCost * BestCost;
+		float LeafCost = settings.IntersectionCost * Count;
+		if (SplitCost >= LeafCost && Count <= settings.MaxLeafSize) {
+			return;
+		}
+
+		parent->ChildA = new Node();
+		parent->ChildB = new Node();
+		bool bSplit = false;
+		if (SpatialCost < RelativeCost) {
+			parent->SplitAxis = SpatialAxis;
+			bSplit = SpatialPartition(parent, SpatialAxis, SpatialPos, Budget);
+		}
+		if (!bSplit) {
+			if (SplitAxis < 0) {
+				delete parent->ChildA;
+				delete parent->ChildB;
+				parent->ChildA = parent->ChildB = nullptr;
+				return;
 			}
-			else if (bInAB(sphere, Axis, Pos)) {
-				ASpheres.AddSphere(sphere);
-				BSpheres.AddSphere(sphere);
-				OverlappedCount++;
+			parent->SplitAxis = SplitAxis;
+			ObjectPartition(parent, SplitAxis, SplitBin, settings.BinCount);
+		}
+
+		// ONLY LEAVES ARE TESTED AGAINST, FREE THE INNER NODE LIST
+		std::vector<Sphere*>().swap(parent->spheres);
+		std::vector<BoundingBox>().swap(parent->RefBounds);
+
+		// SHARE WHAT IS LEFT OF THE BUDGET BY REFERENCE COUNT, SO NO TWO SUBTREES
+		// EVER DRAW FROM THE SAME ONE AND THE TREE DOESN'T DEPEND ON THREAD TIMING
+		int64_t CountA = (int64_t)parent->ChildA->spheres.size();
+		int64_t CountB = (int64_t)parent->ChildB->spheres.size();
+		int BudgetA = (int)(Budget * CountA / (CountA + CountB));
+		SplitNode(parent->ChildA, depth + 1, BudgetA, settings, context, bTopLevel);
+		SplitNode(parent->ChildB, depth + 1, Budget - BudgetA, settings, context, bTopLevel);
+	}
+
+	void ObjectPartition(Node* parent, int Axis, int SplitBin, int BinCount) {
+		BoundingBox CentroidBounds;
+		for (auto& box : parent->RefBounds)
+			CentroidBounds.GrowToInclude(box.Center);
+		float Extent = CentroidBounds.Max[Axis] - CentroidBounds.Min[Axis];
+
+		for (size_t r = 0; r < parent->spheres.size(); r++) {
+			const BoundingBox& box = parent->RefBounds[r];
+			if (BinIndex(box.Center[Axis], CentroidBounds.Min[Axis], Extent, BinCount) < SplitBin)
+				parent->ChildA->AddReference(parent->spheres[r], box);
+			else
+				parent->ChildB->AddReference(parent->spheres[r], box);
+		}
+	}
+
+	// Splits space at Pos, straddling references go to both sides while the
+	// reference budget lasts and to the side of their centroid after that.
+	// Returns false, leaving the children empty and the budget untouched, if
+	// one side got nothing
+	bool SpatialPartition(Node* parent, int Axis, float Pos, int& Budget) {
+		int Spent = 0;
+		for (size_t r = 0; r < parent->spheres.size(); r++) {
+			Sphere* sphere = parent->spheres[r];
+			const BoundingBox& box = parent->RefBounds[r];
+			if (box.Max[Axis] <= Pos)
+				parent->ChildA->AddReference(sphere, box);
+			else if (box.Min[Axis] >= Pos)
+				parent->ChildB->AddReference(sphere, box);
+			else if (Spent < Budget) {
+				Spent++;
+				parent->ChildA->AddReference(sphere, ClipReference(sphere, box, Axis, box.Min[Axis], Pos));
+				parent->ChildB->AddReference(sphere, ClipReference(sphere, box, Axis, Pos, box.Max[Axis]));
 			}
 			else {
-				assert(false && "ERROR :: SPLITFUNCTION :: NO SUBDIVISION");
+				// OUT OF BUDGET
+				if (box.Center[Axis] < Pos)
+					parent->ChildA->AddReference(sphere, box);
+				else
+					parent->ChildB->AddReference(sphere, box);
 			}
 		}
 
-		// SURFACE AREA HEURISTIC
-		float surfaceAreaA = ASpheres.bounds.SurfaceArea();
-		float surfaceAreaB = BSpheres.bounds.SurfaceArea();
-		float surfaceAreaParent = RootAxis->bounds.SurfaceArea();
+		if (!parent->ChildA->spheres.empty() && !parent->ChildB->spheres.empty()) {
+			Budget -= Spent;
+			return true;
+		}
+
+		// LET THE CALLER FALL BACK ON AN OBJECT SPLIT
+		delete parent->ChildA;
+		delete parent->ChildB;
+		parent->ChildA = new Node();
+		parent->ChildB = new Node();
+		return false;
+	}
+
+	// Part of the reference box inside the slab [SlabMin, SlabMax] along
+	// Axis. The slice of a sphere is no wider than its largest cross section
+	// in the slab, which also tightens the other two axes
+	static BoundingBox ClipReference(Sphere* sp, const BoundingBox& box, int Axis, float SlabMin, float SlabMax) {
+		BoundingBox clipped;
+		clipped.Min = box.Min;
+		clipped.Max = box.Max;
+		clipped.Min[Axis] = std::max((float)box.Min[Axis], SlabMin);
+		clipped.Max[Axis] = std::min((float)box.Max[Axis], SlabMax);
+
+		float c = sp->center[Axis];
+		float d = c < SlabMin ? SlabMin - c : (c > SlabMax ? c - SlabMax : 0.0f);
+		float r = sqrt(std::max(sp->radius * sp->radius - d * d, 0.0f));
+		for (int k = 0; k < 3; k++) {
+			if (k == Axis)
+				continue;
+			clipped.Min[k] = std::max((float)clipped.Min[k], (float)sp->center[k] - r);
+			clipped.Max[k] = std::min((float)clipped.Max[k], (float)sp->center[k] + r);
+		}
+		clipped.Center = (clipped.Min + clipped.Max) / 2;
+		return clipped;
+	}
+
+	static BoundingBox Overlap(const BoundingBox& a, const BoundingBox& b) {
+		BoundingBox overlap;
+		overlap.Min = max(a.Min, b.Min);
+		overlap.Max = min(a.Max, b.Max);
+		for (int k = 0; k < 3; k++) {
+			if (overlap.Min[k] > overlap.Max[k])
+				return BoundingBox();
+		}
+		return overlap;
+	}
+
+	static int BinIndex(float Pos, float Min, float Extent, int BinCount) {
+		int Index = int((Pos - Min) * (BinCount / Extent));
+		return std::min(std::max(Index, 0), BinCount - 1);
+	}
+};
 
-		float costA = (surfaceAreaA / surfaceAreaParent) * (ASpheres.spheres.size());
-		float costB = (surfaceAreaB / surfaceAreaParent) * (BSpheres.spheres.size());
 
-		// DISCOURAGE OVERLAPPING * CONSTANT
-		float overlapPenalty = OverlappedCount * 1.5;
 
-		float totalCost = costA + costB + overlapPenalty;
-		return totalCost;
+// Node of the flattened BVH, 32 bytes so two of them share a cache line
+struct alignas(32) FlatNode
+{
+	float Min[3];
+	// inner node: index of the second child, the first one directly follows
+	// leaf: index of the first primitive in FlatBVH::Primitives
+	int Offset;
+	float Max[3];
+	// number of primitives in the leaf, 0 for inner nodes
+	unsigned Count : 30;
+	// axis the inner node was split along, used to order traversal
+	unsigned Axis : 2;
+
+	bool IsLeaf() const {
+		return Count > 0;
+	}
+
+	// SLAB TEST AGAINST A RAY ALREADY CONVERTED TO FLOAT
+	bool BoxIntersection(const float Origin[3], const float InvDir[3], float maxDist) const {
+		float tMin = 0.0f;
+		float tMax = maxDist;
+		for (int i = 0; i < 3; i++) {
+			float t0 = (Min[i] - Origin[i]) * InvDir[i];
+			float t1 = (Max[i] - Origin[i]) * InvDir[i];
+			tMin = std::max(tMin, std::min(t0, t1));
+			tMax = std::min(tMax, std::max(t0, t1));
+		}
+		return tMin <= tMax;
 	}
+};
 
-	void SplitNode(Node* parent, int depth) {
-		const int MaxDepth = 4;
 
-		if (depth == MaxDepth || parent->spheres.size() <= 4) {
+// Depth first, contiguous copy of a Node tree used for traversal
+class FlatBVH
+{
+public:
+	std::vector<FlatNode> Nodes;
+	// index into the scene sphere list for every primitive slot, leaf order
+	std::vector<unsigned> PrimIndices;
+	// PrimIndices resolved to the spheres themselves
+	std::vector<Sphere*> Primitives;
+	// number of spheres the tree was built over
+	unsigned SceneSize = 0;
+
+	void Flatten(Node* root, const std::vector<Sphere*>& scene) {
+		Nodes.clear();
+		PrimIndices.clear();
+		Primitives.clear();
+		SceneSize = (unsigned)scene.size();
+
+		std::unordered_map<Sphere*, unsigned> SceneIndex;
+		for (unsigned i = 0; i < scene.size(); i++)
+			SceneIndex[scene[i]] = i;
+
+		if (!root || (root->IsLeaf() && root->spheres.empty()))
 			return;
-		}
+		FlattenNode(root, SceneIndex, 0);
 
-		int SpiltAxis;
-		float SplitPos;
+		Primitives.reserve(PrimIndices.size());
+		for (unsigned index : PrimIndices)
+			Primitives.push_back(scene[index]);
+	}
 
-		FindBestSplit(parent, SpiltAxis, SplitPos);
-		parent->ChildA = new Node();
-		parent->ChildB = new Node();
-		for (auto sphere : parent->spheres) {
-			vec3 size;
-			size = sphere->center;
-            if (bInA(sphere, SpiltAxis, SplitPos)) {
-				parent->ChildA->AddSphere(sphere);
+	bool Empty() const {
+		return Nodes.empty();
+	}
+
+	// references per sphere, above 1 when spatial splits duplicated spheres
+	float DuplicationFactor() const {
+		return SceneSize ? float(PrimIndices.size()) / SceneSize : 1.0f;
+	}
+
+	// Recomputes every node's bounds bottom up after spheres moved or changed
+	// radius, keeping the topology. Children always come after their parent,
+	// so one backwards pass sees them first. Spatial split clipping is lost,
+	// leaves grow back to whole spheres
+	void Refit() {
+		for (int i = (int)Nodes.size() - 1; i >= 0; i--) {
+			FlatNode& node = Nodes[i];
+			BoundingBox box;
+			if (node.IsLeaf()) {
+				for (unsigned p = 0; p < node.Count; p++)
+					box.GrowToInclude(Primitives[node.Offset + p]);
+				for (int k = 0; k < 3; k++) {
+					node.Min[k] = (float)box.Min[k];
+					node.Max[k] = (float)box.Max[k];
+				}
+			}
+			else {
+				const FlatNode& a = Nodes[i + 1];
+				const FlatNode& b = Nodes[node.Offset];
+				for (int k = 0; k < 3; k++) {
+					node.Min[k] = std::min(a.Min[k], b.Min[k]);
+					node.Max[k] = std::max(a.Max[k], b.Max[k]);
+				}
 			}
-			else if (bInB(sphere, SpiltAxis, SplitPos)) {
-				parent->ChildB->AddSphere(sphere);
-            }
-			else if (bInAB(sphere, SpiltAxis, SplitPos)) {
-                parent->ChildA->AddSphere(sphere);
-                parent->ChildB->AddSphere(sphere);
-            } else {
-				assert(false && "ERROR :: SPLITFUNCTION :: NO SUBDIVISION");
-            }
 		}
-		SplitNode(parent->ChildA, depth + 1);
-		SplitNode(parent->ChildB, depth + 1);
 	}
 
-	bool bInA(Sphere* sp, int axis, float Spos) {
-		return sp->center[axis] + sp->radius <= Spos;
+	// SAH cost of the whole tree: expected cost of tracing a ray that hits the
+	// root, used to notice when refitting has degraded the tree too far
+	float SAHCost(float TraversalCost, float IntersectionCost) const {
+		if (Nodes.empty())
+			return 0.0f;
+		float RootArea = NodeArea(Nodes[0]);
+		if (RootArea <= 0.0f)
+			return 0.0f;
+		float Cost = 0.0f;
+		for (const FlatNode& node : Nodes) {
+			float Weight = node.IsLeaf() ? IntersectionCost * node.Count : TraversalCost;
+			Cost += Weight * NodeArea(node);
+		}
+		return Cost / RootArea;
 	}
 
-	bool bInB(Sphere* sp, int axis, float Spos) {
-		return sp->center[axis] - sp->radius >= Spos;
+private:
+	static float NodeArea(const FlatNode& node) {
+		float x = node.Max[0] - node.Min[0];
+		float y = node.Max[1] - node.Min[1];
+		float z = node.Max[2] - node.Min[2];
+		return 2 * (x * y + x * z + y * z);
 	}
 
-	bool bInAB(Sphere* sp, int axis, float Spos) {
-		return (sp->center[axis] - sp->radius < Spos) && (sp->center[axis] + sp->radius > Spos);
+	int FlattenNode(Node* node, const std::unordered_map<Sphere*, unsigned>& SceneIndex, int depth) {
+		assert(depth < BVHStackSize && "ERROR :: FLATTEN :: TREE TOO DEEP FOR TRAVERSAL STACK");
+		int Index = (int)Nodes.size();
+		Nodes.emplace_back();
+		FlatNode flat;
+		for (int i = 0; i < 3; i++) {
+			flat.Min[i] = (float)node->bounds.Min[i];
+			flat.Max[i] = (float)node->bounds.Max[i];
+		}
+
+		if (node->IsLeaf()) {
+			flat.Offset = (int)PrimIndices.size();
+			flat.Count = (unsigned)node->spheres.size();
+			flat.Axis = 0;
+			for (auto sphere : node->spheres)
+				PrimIndices.push_back(SceneIndex.at(sphere));
+		}
+		else {
+			FlattenNode(node->ChildA, SceneIndex, depth + 1);
+			flat.Offset = FlattenNode(node->ChildB, SceneIndex, depth + 1);
+			flat.Count = 0;
+			flat.Axis = node->SplitAxis;
+		}
+		Nodes[Index] = flat;
+		return Index;
 	}
 };
-
@@ -0,0 +1,302 @@
+#include "raytracer.h"
+#include "bvhcache.h"
+#include <cstdio>
+#include <cstring>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace
+{
+
+struct BVHCacheHeader
+{
+    char Magic[8];
+    uint32_t Version;
+    uint32_t NodeSize;
+    uint64_t SceneHash;
+    uint32_t NodeCount;
+    uint32_t PrimCount;
+    uint32_t SceneSize;
+    uint32_t Padding;
+};
+
+const char CacheMagic[8] = { 'T', 'R', 'A', 'Y', 'B', 'V', 'H', '\0' };
+
+//------------------------------------------------------------------------------
+/**
+    FNV-1a
+*/
+void
+HashBytes(uint64_t& hash, const void* data, size_t size)
+{
+    const unsigned char* bytes = static_cast<const unsigned char*>(data);
+    for (size_t i = 0; i < size; i++)
+    {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3ull;
+    }
+}
+
+template<typename T>
+void
+HashValue(uint64_t& hash, const T& value)
+{
+    HashBytes(hash, &value, sizeof(T));
+}
+
+//------------------------------------------------------------------------------
+/**
+    Read-only view of a whole file, unmapped when it goes out of scope
+*/
+class MappedFile
+{
+public:
+    explicit MappedFile(const std::string& path)
+    {
+#ifdef _WIN32
+        this->file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (this->file == INVALID_HANDLE_VALUE)
+            return;
+        LARGE_INTEGER fileSize;
+        if (!GetFileSizeEx(this->file, &fileSize) || fileSize.QuadPart == 0)
+            return;
+        this->mapping = CreateFileMappingA(this->file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (!this->mapping)
+            return;
+        this->data = MapViewOfFile(this->mapping, FILE_MAP_READ, 0, 0, 0);
+        if (this->data)
+            this->size = (size_t)fileSize.QuadPart;
+#else
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+            return;
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size > 0)
+        {
+            void* view = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (view != MAP_FAILED)
+            {
+                this->data = view;
+                this->size = (size_t)st.st_size;
+            }
+        }
+        close(fd);
+#endif
+    }
+
+    ~MappedFile()
+    {
+#ifdef _WIN32
+        if (this->data)
+            UnmapViewOfFile(this->data);
+        if (this->mapping)
+            CloseHandle(this->mapping);
+        if (this->file != INVALID_HANDLE_VALUE)
+            CloseHandle(this->file);
+#else
+        if (this->data)
+            munmap(this->data, this->size);
+#endif
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    const char* Data() const { return static_cast<const char*>(this->data); }
+    size_t Size() const { return this->size; }
+
+private:
+    void* data = nullptr;
+    size_t size = 0;
+#ifdef _WIN32
+    HANDLE file = INVALID_HANDLE_VALUE;
+    HANDLE mapping = nullptr;
+#endif
+};
+
+} // namespace
+
+//------------------------------------------------------------------------------
+/**
+*/
+uint64_t
+HashScene(const std::vector<Sphere*>& spheres, const BVHBuildSettings& settings)
+{
+    uint64_t hash = 0xcbf29ce484222325ull;
+    HashValue(hash, BVHCacheVersion);
+
+    HashValue(hash, (int)settings.Builder);
+    HashValue(hash, settings.BinCount);
+    HashValue(hash, settings.MaxLeafSize);
+    HashValue(hash, settings.TraversalCost);
+    HashValue(hash, settings.IntersectionCost);
+    HashValue(hash, settings.MaxDepth);
+    HashValue(hash, (int)settings.SplitMode);
+    HashValue(hash, settings.SpatialSplitAlpha);
+    HashValue(hash, settings.MaxDuplication);
+    HashValue(hash, settings.bWideMortonCodes);
+    HashValue(hash, settings.TreeletBits);
+    HashValue(hash, settings.bTreeletSAH);
+
+    uint64_t count = spheres.size();
+    HashValue(hash, count);
+    for (const Sphere* sphere : spheres)
+    {
+        HashValue(hash, sphere->center.x);
+        HashValue(hash, sphere->center.y);
+        HashValue(hash, sphere->center.z);
+        HashValue(hash, sphere->radius);
+    }
+    return hash;
+}
+
+//------------------------------------------------------------------------------
+/**
+*/
+std::string
+BVHCachePath(const std::string& directory, uint64_t sceneHash)
+{
+    char name[32];
+    snprintf(name, sizeof(name), "%016llx.bvh", (unsigned long long)sceneHash);
+    if (directory.empty())
+        return name;
+    char last = directory.back();
+    if (last == '/' || last == '\\')
+        return directory + name;
+    return directory + "/" + name;
+}
+
+//------------------------------------------------------------------------------
+/**
+*/
+bool
+SaveBVHCache(const std::string& path, uint64_t sceneHash, const FlatBVH& bvh)
+{
+    BVHCacheHeader header = {};
+    memcpy(header.Magic, CacheMagic, sizeof(CacheMagic));
+    header.Version = BVHCacheVersion;
+    header.NodeSize = sizeof(FlatNode);
+    header.SceneHash = sceneHash;
+    header.NodeCount = (uint32_t)bvh.Nodes.size();
+    header.PrimCount = (uint32_t)bvh.PrimIndices.size();
+    header.SceneSize = bvh.SceneSize;
+
+    // WRITE NEXT TO THE TARGET AND RENAME, SO A CONCURRENT READER NEVER SEES HALF A FILE
+    std::string tmpPath = path + ".tmp";
+    FILE* file = fopen(tmpPath.c_str(), "wb");
+    if (!file)
+        return false;
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+    if (ok && header.NodeCount)
+        ok = fwrite(bvh.Nodes.data(), sizeof(FlatNode), header.NodeCount, file) == header.NodeCount;
+    if (ok && header.PrimCount)
+        ok = fwrite(bvh.PrimIndices.data(), sizeof(unsigned), header.PrimCount, file) == header.PrimCount;
+    ok = (fclose(file) == 0) && ok;
+
+    if (ok)
+    {
+        remove(path.c_str());
+        ok = rename(tmpPath.c_str(), path.c_str()) == 0;
+    }
+    if (!ok)
+        remove(tmpPath.c_str());
+    return ok;
+}
+
+//------------------------------------------------------------------------------
+/**
+*/
+bool
+LoadBVHCache(const std::string& path, uint64_t sceneHash, const std::vector<Sphere*>& scene, FlatBVH& bvh)
+{
+    MappedFile file(path);
+    if (file.Size() < sizeof(BVHCacheHeader))
+        return false;
+
+    BVHCacheHeader header;
+    memcpy(&header, file.Data(), sizeof(header));
+    if (memcmp(header.Magic, CacheMagic, sizeof(CacheMagic)) != 0
+        || header.Version != BVHCacheVersion
+        || header.NodeSize != sizeof(FlatNode)
+        || header.SceneHash != sceneHash
+        || header.SceneSize != scene.size())
+        return false;
+
+    size_t nodeBytes = (size_t)header.NodeCount * sizeof(FlatNode);
+    size_t primBytes = (size_t)header.PrimCount * sizeof(unsigned);
+    if (file.Size() != sizeof(header) + nodeBytes + primBytes)
+        return false;
+
+    const char* nodes = file.Data() + sizeof(header);
+    const char* prims = nodes + nodeBytes;
+
+    // A MATCHING HASH DOES NOT MAKE THE FILE TRUSTWORTHY, NEVER HAND TRAVERSAL AN OUT OF RANGE INDEX
+    std::vector<FlatNode> flatNodes(header.NodeCount);
+    if (nodeBytes)
+        memcpy(flatNodes.data(), nodes, nodeBytes);
+    for (uint32_t i = 0; i < header.NodeCount; i++)
+    {
+        const FlatNode& node = flatNodes[i];
+        bool valid = node.IsLeaf()
+            ? (node.Offset >= 0 && (uint64_t)node.Offset + node.Count <= header.PrimCount)
+            : ((uint32_t)node.Offset > i + 1 && (uint32_t)node.Offset < header.NodeCount);
+        if (!valid)
+            return false;
+    }
+
+    // THE TRAVERSAL STACKS AND THE RECURSIVE COLLAPSE ONLY HOLD BVHStackSize LEVELS,
+    // AND EVERY NODE HAS TO HANG IN THE TREE EXACTLY ONCE
+    if (header.NodeCount)
+    {
+        std::vector<bool> reached(header.NodeCount, false);
+        std::vector<std::pair<uint32_t, int>> stack;
+        stack.push_back({ 0, 0 });
+        uint32_t reachedCount = 0;
+        while (!stack.empty())
+        {
+            uint32_t index = stack.back().first;
+            int depth = stack.back().second;
+            stack.pop_back();
+            if (reached[index] || depth >= BVHStackSize)
+                return false;
+            reached[index] = true;
+            reachedCount++;
+
+            const FlatNode& node = flatNodes[index];
+            if (!node.IsLeaf())
+            {
+                stack.push_back({ (uint32_t)node.Offset, depth + 1 });
+                stack.push_back({ index + 1, depth + 1 });
+            }
+        }
+        if (reachedCount != header.NodeCount)
+            return false;
+    }
+
+    std::vector<unsigned> primIndices(header.PrimCount);
+    if (primBytes)
+        memcpy(primIndices.data(), prims, primBytes);
+    for (unsigned index : primIndices)
+    {
+        if (index >= scene.size())
+            return false;
+    }
+
+    bvh.Nodes = std::move(flatNodes);
+    bvh.PrimIndices = std::move(primIndices);
+    bvh.SceneSize = header.SceneSize;
+    bvh.Primitives.clear();
+    bvh.Primitives.reserve(bvh.PrimIndices.size());
+    for (unsigned index : bvh.PrimIndices)
+        bvh.Primitives.push_back(scene[index]);
+    return true;
+}
@@ -0,0 +1,29 @@
+#pragma once
+#include "bvh.h"
+#include <cstdint>
+#include <string>
+
+//------------------------------------------------------------------------------
+/**
+    On-disk cache for FlatBVH. A cache file holds a small versioned header
+    followed by the raw node array and the primitive index array, so loading
+    it is a mmap and two copies.
+*/
+
+/// bump whenever FlatNode or the file layout changes
+constexpr uint32_t BVHCacheVersion = 1;
+
+/// Hash of everything that decides what the built BVH looks like: every sphere's
+/// center and radius, in order, and the build settings.
+uint64_t HashScene(const std::vector<Sphere*>& spheres, const BVHBuildSettings& settings);
+
+/// File name the BVH of a scene with this hash is cached under inside directory
+std::string BVHCachePath(const std::string& directory, uint64_t sceneHash);
+
+/// Writes the BVH to path, returns false if the file could not be written
+bool SaveBVHCache(const std::string& path, uint64_t sceneHash, const FlatBVH& bvh);
+
+/// Maps the file at path and, if its version and scene hash match, loads it
+/// into bvh with its primitives resolved against scene. Returns false, leaving
+/// bvh untouched, if the file is missing, stale or malformed.
+bool LoadBVHCache(const std::string& path, uint64_t sceneHash, const std::vector<Sphere*>& scene, FlatBVH& bvh);
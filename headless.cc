@@ -0,0 +1,14 @@
+#include "app.h"
+
+//------------------------------------------------------------------------------
+/**
+    Batch renderer for machines without a GPU or display, takes the same
+    arguments as the viewer and always behaves as if -headless was given.
+*/
+int main(int argc, char* argv[])
+{
+    AppOptions options;
+    if (!ParseOptions(argc, argv, options))
+        return 1;
+    return RunHeadless(options);
+}
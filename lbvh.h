@@ -0,0 +1,410 @@
+#pragma once
+#include "bvh.h"
+#include <cstdint>
+#include <vector>
+
+
+//------------------------------------------------------------------------------
+/**
+	Spreads the low 10 bits of v out so there are two zero bits between each
+*/
+inline uint64_t
+ExpandBits10(uint64_t v)
+{
+	v &= 0x3ff;
+	v = (v | (v << 16)) & 0x030000ff;
+	v = (v | (v << 8)) & 0x0300f00f;
+	v = (v | (v << 4)) & 0x030c30c3;
+	v = (v | (v << 2)) & 0x09249249;
+	return v;
+}
+
+//------------------------------------------------------------------------------
+/**
+	Spreads the low 21 bits of v out so there are two zero bits between each
+*/
+inline uint64_t
+ExpandBits21(uint64_t v)
+{
+	v &= 0x1fffff;
+	v = (v | (v << 32)) & 0x1f00000000ffffull;
+	v = (v | (v << 16)) & 0x1f0000ff0000ffull;
+	v = (v | (v << 8)) & 0x100f00f00f00f00full;
+	v = (v | (v << 4)) & 0x10c30c30c30c30c3ull;
+	v = (v | (v << 2)) & 0x1249249249249249ull;
+	return v;
+}
+
+//------------------------------------------------------------------------------
+/**
+	Index of the highest set bit, v must not be 0
+*/
+inline int
+HighestBit(uint64_t v)
+{
+	int Bit = 0;
+	while (v >>= 1)
+		Bit++;
+	return Bit;
+}
+
+
+//------------------------------------------------------------------------------
+/**
+	Linear BVH builder. Sorts the spheres along a Morton curve with a parallel
+	radix sort, cuts the sorted list into treelets sharing the top TreeletBits
+	of their code, emits every treelet in parallel by splitting at the highest
+	differing code bit, and joins the treelets with binned SAH (or the same
+	Morton splits when bTreeletSAH is off). Writes straight into a FlatBVH,
+	no Node tree is built.
+*/
+class LBVHBuilder
+{
+public:
+	void Build(FlatBVH& bvh, const std::vector<Sphere*>& scene, const BVHBuildSettings& settings,
+		const BVHTaskRunner* runner) {
+		this->Scene = &scene;
+		this->Settings = &settings;
+		this->Runner = runner;
+		this->CodeBits = settings.bWideMortonCodes ? 63 : 30;
+
+		bvh.Nodes.clear();
+		bvh.PrimIndices.clear();
+		bvh.Primitives.clear();
+		bvh.SceneSize = (unsigned)scene.size();
+		if (scene.empty())
+			return;
+
+		ComputeCodes();
+		RadixSort();
+		BuildTreelets();
+
+		std::vector<int> All(Treelets.size());
+		for (size_t i = 0; i < Treelets.size(); i++)
+			All[i] = (int)i;
+		EmitTop(bvh, All, 0);
+
+		bvh.PrimIndices = Order;
+		bvh.Primitives.reserve(Order.size());
+		for (unsigned index : Order)
+			bvh.Primitives.push_back(scene[index]);
+	}
+
+private:
+	// Spheres sharing the top bits of their Morton code, emitted on their own
+	struct Treelet
+	{
+		int First, Last;
+		std::vector<FlatNode> Nodes;
+		BoundingBox Bounds;
+	};
+
+	const std::vector<Sphere*>* Scene = nullptr;
+	const BVHBuildSettings* Settings = nullptr;
+	const BVHTaskRunner* Runner = nullptr;
+	int CodeBits = 30;
+	// sorted along with Order, Codes[i] belongs to Scene[Order[i]]
+	std::vector<uint64_t> Codes;
+	std::vector<unsigned> Order;
+	std::vector<Treelet> Treelets;
+
+	int TopDepthLimit() const {
+		return 2 * Settings->TreeletBits;
+	}
+
+	// Cuts [0, Count) into one range per worker and runs Fn(Begin, End, Chunk)
+	// on each, on the calling thread when there is no runner
+	template<typename F>
+	void ParallelFor(size_t Count, int Chunks, F Fn) {
+		if (Chunks == 1) {
+			Fn(size_t(0), Count, 0);
+			return;
+		}
+		std::vector<std::function<void()>> tasks;
+		for (int c = 0; c < Chunks; c++) {
+			tasks.push_back([&, c]() {
+				Fn(Count * c / Chunks, Count * (c + 1) / Chunks, c);
+			});
+		}
+		Runner->Run(tasks);
+	}
+
+	int NumChunks(size_t Count) const {
+		if (!Runner || Runner->Workers <= 1 || Count < (size_t)Settings->ParallelBinThreshold)
+			return 1;
+		return Runner->Workers;
+	}
+
+	void ComputeCodes() {
+		const std::vector<Sphere*>& scene = *Scene;
+		BoundingBox CentroidBounds;
+		for (auto sphere : scene)
+			CentroidBounds.GrowToInclude(sphere->center);
+		vec3 Extent = CentroidBounds.Size();
+
+		int AxisBits = CodeBits / 3;
+		double Scale[3];
+		for (int i = 0; i < 3; i++)
+			Scale[i] = Extent[i] > 0 ? ((1u << AxisBits) - 1) / Extent[i] : 0.0;
+
+		Codes.resize(scene.size());
+		Order.resize(scene.size());
+		ParallelFor(scene.size(), NumChunks(scene.size()), [&](size_t Begin, size_t End, int) {
+			for (size_t i = Begin; i < End; i++) {
+				uint64_t q[3];
+				for (int k = 0; k < 3; k++)
+					q[k] = (uint64_t)((scene[i]->center[k] - CentroidBounds.Min[k]) * Scale[k]);
+				// X TAKES THE HIGHEST BIT OF EVERY TRIPLE, Z THE LOWEST
+				if (AxisBits == 10)
+					Codes[i] = (ExpandBits10(q[0]) << 2) | (ExpandBits10(q[1]) << 1) | ExpandBits10(q[2]);
+				else
+					Codes[i] = (ExpandBits21(q[0]) << 2) | (ExpandBits21(q[1]) << 1) | ExpandBits21(q[2]);
+				Order[i] = (unsigned)i;
+			}
+		});
+	}
+
+	// Stable LSD radix sort of Codes/Order, 8 bits per pass. Every chunk
+	// histograms its slice, offsets are laid out digit major, chunk minor so
+	// each chunk scatters into its own region and the order stays stable
+	void RadixSort() {
+		size_t Count = Codes.size();
+		int Chunks = NumChunks(Count);
+		std::vector<uint64_t> CodesTmp(Count);
+		std::vector<unsigned> OrderTmp(Count);
+		std::vector<size_t> Histogram(Chunks * 256);
+
+		for (int Shift = 0; Shift < CodeBits; Shift += 8) {
+			std::fill(Histogram.begin(), Histogram.end(), 0);
+			ParallelFor(Count, Chunks, [&](size_t Begin, size_t End, int c) {
+				size_t* Hist = &Histogram[c * 256];
+				for (size_t i = Begin; i < End; i++)
+					Hist[(Codes[i] >> Shift) & 0xff]++;
+			});
+
+			size_t Sum = 0;
+			for (int Digit = 0; Digit < 256; Digit++) {
+				for (int c = 0; c < Chunks; c++) {
+					size_t n = Histogram[c * 256 + Digit];
+					Histogram[c * 256 + Digit] = Sum;
+					Sum += n;
+				}
+			}
+
+			ParallelFor(Count, Chunks, [&](size_t Begin, size_t End, int c) {
+				size_t* Offsets = &Histogram[c * 256];
+				for (size_t i = Begin; i < End; i++) {
+					size_t Dst = Offsets[(Codes[i] >> Shift) & 0xff]++;
+					CodesTmp[Dst] = Codes[i];
+					OrderTmp[Dst] = Order[i];
+				}
+			});
+			Codes.swap(CodesTmp);
+			Order.swap(OrderTmp);
+		}
+	}
+
+	void BuildTreelets() {
+		Treelets.clear();
+		int Shift = std::max(CodeBits - Settings->TreeletBits, 0);
+		int First = 0;
+		for (int i = 1; i <= (int)Codes.size(); i++) {
+			if (i == (int)Codes.size() || (Codes[i] >> Shift) != (Codes[First] >> Shift)) {
+				Treelet treelet;
+				treelet.First = First;
+				treelet.Last = i;
+				Treelets.push_back(std::move(treelet));
+				First = i;
+			}
+		}
+
+		int DepthLimit = std::max(Settings->MaxDepth - TopDepthLimit(), 1);
+		std::vector<std::function<void()>> tasks;
+		for (auto& treelet : Treelets) {
+			tasks.push_back([this, &treelet, DepthLimit]() {
+				EmitRange(treelet.Nodes, treelet.First, treelet.Last, 0, DepthLimit, treelet.Bounds);
+			});
+		}
+		if (Runner && Runner->Workers > 1 && Codes.size() >= (size_t)Settings->ParallelSubtreeSize)
+			Runner->Run(tasks);
+		else {
+			for (auto& task : tasks)
+				task();
+		}
+	}
+
+	static void SetBounds(FlatNode& node, const BoundingBox& box) {
+		for (int i = 0; i < 3; i++) {
+			node.Min[i] = (float)box.Min[i];
+			node.Max[i] = (float)box.Max[i];
+		}
+	}
+
+	// Splits the sorted range where its highest differing code bit flips,
+	// or in the middle when every code is the same. Returns the first index
+	// of the upper half
+	int FindSplit(int First, int Last, int& Axis) {
+		uint64_t Diff = Codes[First] ^ Codes[Last - 1];
+		if (Diff == 0) {
+			Axis = 0;
+			return (First + Last) / 2;
+		}
+		int Bit = HighestBit(Diff);
+		Axis = 2 - Bit % 3;
+
+		// THE BIT IS 0 FOR THE LOWER PART OF THE RANGE AND 1 AFTER
+		int Lo = First, Hi = Last - 1;
+		while (Lo + 1 < Hi) {
+			int Mid = (Lo + Hi) / 2;
+			if ((Codes[Mid] >> Bit) & 1)
+				Hi = Mid;
+			else
+				Lo = Mid;
+		}
+		return Hi;
+	}
+
+	// Emits the sorted range [First, Last) depth first into Out, inner node
+	// offsets are relative to Out. Returns the node index, Bounds its bounds
+	int EmitRange(std::vector<FlatNode>& Out, int First, int Last, int depth, int DepthLimit, BoundingBox& Bounds) {
+		int Index = (int)Out.size();
+		Out.emplace_back();
+		FlatNode node;
+		int Count = Last - First;
+
+		if (Count <= Settings->MaxLeafSize || depth >= DepthLimit) {
+			Bounds = BoundingBox();
+			for (int i = First; i < Last; i++)
+				Bounds.GrowToInclude((*Scene)[Order[i]]);
+			node.Offset = First;
+			node.Count = Count;
+			node.Axis = 0;
+		}
+		else {
+			int Axis;
+			int Split = FindSplit(First, Last, Axis);
+			BoundingBox Left, Right;
+			EmitRange(Out, First, Split, depth + 1, DepthLimit, Left);
+			node.Offset = EmitRange(Out, Split, Last, depth + 1, DepthLimit, Right);
+			node.Count = 0;
+			node.Axis = Axis;
+			Bounds = Left;
+			Bounds.GrowToInclude(Right);
+		}
+		SetBounds(node, Bounds);
+		Out[Index] = node;
+		return Index;
+	}
+
+	// Joins the treelets (indices into Treelets, in code order) under new
+	// top level nodes, splicing each treelet in where it ends up
+	int EmitTop(FlatBVH& bvh, std::vector<int>& Items, int depth) {
+		if (Items.size() == 1) {
+			Treelet& treelet = Treelets[Items[0]];
+			int Base = (int)bvh.Nodes.size();
+			for (FlatNode node : treelet.Nodes) {
+				if (!node.IsLeaf())
+					node.Offset += Base;
+				bvh.Nodes.push_back(node);
+			}
+			std::vector<FlatNode>().swap(treelet.Nodes);
+			return Base;
+		}
+
+		int Index = (int)bvh.Nodes.size();
+		bvh.Nodes.emplace_back();
+
+		int Axis = -1;
+		std::vector<int> Left, Right;
+		if (Settings->bTreeletSAH && depth < Settings->TreeletBits)
+			SplitTreeletsSAH(Items, Left, Right, Axis);
+		if (Left.empty() || Right.empty()) {
+			// MORTON ORDER SPLIT, ITEMS ARE SORTED BY CODE SO THIS IS A CUT
+			Left.clear();
+			Right.clear();
+			uint64_t Diff = Codes[Treelets[Items.front()].First] ^ Codes[Treelets[Items.back()].First];
+			int Bit = HighestBit(Diff);
+			Axis = 2 - Bit % 3;
+			for (int item : Items)
+				(((Codes[Treelets[item].First] >> Bit) & 1) ? Right : Left).push_back(item);
+		}
+		std::vector<int>().swap(Items);
+
+		EmitTop(bvh, Left, depth + 1);
+		int RightIndex = EmitTop(bvh, Right, depth + 1);
+
+		FlatNode node;
+		const FlatNode& a = bvh.Nodes[Index + 1];
+		const FlatNode& b = bvh.Nodes[RightIndex];
+		for (int i = 0; i < 3; i++) {
+			node.Min[i] = std::min(a.Min[i], b.Min[i]);
+			node.Max[i] = std::max(a.Max[i], b.Max[i]);
+		}
+		node.Offset = RightIndex;
+		node.Count = 0;
+		node.Axis = Axis;
+		bvh.Nodes[Index] = node;
+		return Index;
+	}
+
+	// Binned SAH over the treelet centroids, weighted by sphere count
+	void SplitTreeletsSAH(const std::vector<int>& Items, std::vector<int>& Left, std::vector<int>& Right, int& Axis) {
+		const int BinCount = Settings->BinCount;
+		BoundingBox CentroidBounds, ParentBounds;
+		for (int item : Items) {
+			CentroidBounds.GrowToInclude(Treelets[item].Bounds.Center);
+			ParentBounds.GrowToInclude(Treelets[item].Bounds);
+		}
+		vec3 Extent = CentroidBounds.Size();
+
+		std::vector<Bin> Bins(3 * BinCount);
+		for (int item : Items) {
+			const Treelet& treelet = Treelets[item];
+			for (int k = 0; k < 3; k++) {
+				if (Extent[k] <= 0.0f)
+					continue;
+				Bin& bin = Bins[k * BinCount + Node::BinIndex(treelet.Bounds.Center[k], CentroidBounds.Min[k], Extent[k], BinCount)];
+				bin.bounds.GrowToInclude(treelet.Bounds);
+				bin.count += treelet.Last - treelet.First;
+			}
+		}
+
+		float BestCost = FLT_MAX;
+		int BestBin = -1;
+		std::vector<float> RightCost(BinCount);
+		for (int k = 0; k < 3; k++) {
+			if (Extent[k] <= 0.0f)
+				continue;
+			const Bin* AxisBins = &Bins[k * BinCount];
+			BoundingBox Box;
+			int Sum = 0;
+			for (int i = BinCount - 1; i > 0; i--) {
+				Box.GrowToInclude(AxisBins[i].bounds);
+				Sum += AxisBins[i].count;
+				RightCost[i] = Sum ? Box.SurfaceArea() * Sum : -1.0f;
+			}
+			Box = BoundingBox();
+			Sum = 0;
+			for (int i = 1; i < BinCount; i++) {
+				Box.GrowToInclude(AxisBins[i - 1].bounds);
+				Sum += AxisBins[i - 1].count;
+				if (Sum == 0 || RightCost[i] < 0.0f)
+					continue;
+				float Cost = Box.SurfaceArea() * Sum + RightCost[i];
+				if (Cost < BestCost) {
+					BestCost = Cost;
+					BestBin = i;
+					Axis = k;
+				}
+			}
+		}
+		if (BestBin < 0)
+			return;
+
+		for (int item : Items) {
+			const Treelet& treelet = Treelets[item];
+			int b = Node::BinIndex(treelet.Bounds.Center[Axis], CentroidBounds.Min[Axis], Extent[Axis], BinCount);
+			(b < BestBin ? Left : Right).push_back(item);
+		}
+	}
+};
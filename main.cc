@@ -7,47 +7,22 @@
 #include <iostream>
 #include <thread>
 #include "bvh.h"
-
-#define STB_IMAGE_WRITE_IMPLEMENTATION
-#include "stb_image_write.h"
+#include "app.h"
 
 #define degtorad(angle) angle * MPI / 180
 
 
 int main(int argc, char* argv[])
 { 
-    unsigned w = 1500;
-    unsigned h = 1500;
-    int rpp = 1;
-    int ball = 256;
-    int mb = 5;
-    for (int i = 0; i < argc; i++) {
-        if (strcmp(argv[i], "-w") == 0) {
-            w = std::stoi(argv[i + 1]);
-			std::cout << "width: " << w << std::endl;
-        }
-        else if (strcmp(argv[i], "-h") == 0) {
-            h = std::stoi(argv[i + 1]);
-			std::cout << "height: " << h << std::endl;
-        }
-        else if (strcmp(argv[i], "-rpp") == 0) {
-            rpp = std::stoi(argv[i + 1]);
-            std::cout << "ray per pixel: " << rpp << std::endl;
-        }
-        else if (strcmp(argv[i], "-s") == 0) {
-            ball = std::stoi(argv[i + 1]);
-            std::cout << "SphereAmount: " << ball << std::endl;
-        } 
-        else if (strcmp(argv[i], "-b") == 0) {
-            mb = std::stoi(argv[i + 1]);
-            std::cout << "MaxBounce: " << mb << std::endl;
-        } 
-    }
-    const int width = w;
-    const int height = h;
-    const int RaysPerPixel = rpp;
-    const int SphereAmount = ball;
-    const int maxBounces = mb;
+    AppOptions options;
+    if (!ParseOptions(argc, argv, options))
+        return 1;
+    if (options.bHeadless)
+        return RunHeadless(options);
+    StartTrace(options);
+
+    const int width = options.Width;
+    const int height = options.Height;
     double TotalFrameDuration = 0;
     unsigned int TotalFrame = 0;
     Display::Window wnd;
@@ -61,42 +36,10 @@ int main(int argc, char* argv[])
     framebuffer.resize(width * height);
     
 
-    Raytracer rt = Raytracer(width, height, framebuffer, RaysPerPixel, maxBounces);
+    Raytracer rt = Raytracer(width, height, framebuffer, options.RaysPerPixel, options.MaxBounces, options.Threads);
 
     // Create some objects
-    Material* mat = new Material();
-    mat->type = "Lambertian";
-    mat->color = { 0.5,0.5,0.5 };
-    mat->roughness = 0.3;
-    Sphere* ground = new Sphere(1000, { 0,-1000, -1 }, mat);
-    std::vector<Sphere*> Spheres;
-    rt.AddObject(ground);
-	Spheres.push_back(ground);
-    
-    std::vector<std::string>MaterialType;
-    std::vector<float> SpanVec;
-    MaterialType = { "Lambertian", "Conductor", "Dielectric"};
-    SpanVec = { 10.0f, 30.0f, 25.0f };
-    for (int it = 0; it < SphereAmount; it++)
-    {
-		Material* mat = new Material();
-		mat->type = MaterialType[it % 3];
-		float r = RandomFloat();
-		float g = RandomFloat();
-		float b = RandomFloat();
-		mat->color = { r,g,b };
-		mat->roughness = RandomFloat();
-        Sphere* ground = new Sphere(
-		RandomFloat() * 0.7f + 0.2f,
-		{
-			RandomFloatNTP() * SpanVec[it % 3],
-			RandomFloat() * SpanVec[it % 3] + 0.2f,
-			RandomFloatNTP() * SpanVec[it % 3] 
-		},
-		mat);
-		rt.AddObject(ground);
-        Spheres.push_back(ground);
-    }
+    std::vector<Sphere*> Spheres = CreateScene(rt, options);
     
     bool exit = false;
 
@@ -166,10 +109,8 @@ int main(int argc, char* argv[])
     std::vector<Color> framebufferCopy;
     framebufferCopy.resize(width * height);
 
-    std::vector<std::thread> Threads;
     /// SET UP BVH
-    BoundingBox Box;
-    rt.SetUpNode(Box, Spheres);
+    SetUpBVH(rt, options, Spheres);
 
 
     /// RENDERING LOOP
@@ -205,7 +146,6 @@ int main(int argc, char* argv[])
 			rt.Clear();
 			frameIndex = 0;
 		}
-		double RayNum;
 		auto start = std::chrono::high_resolution_clock::now();
 		rt.AssignJob();
 		auto end = std::chrono::high_resolution_clock::now();
@@ -214,32 +154,13 @@ int main(int argc, char* argv[])
 		frameIndex++;
 		// Get the average distribution of all samples
 		std::vector<uint8_t> ImageData;
-		{
-			size_t p = 0;
-			for (Color const& pixel : framebuffer)
-			{
-				framebufferCopy[p] = pixel;
-				framebufferCopy[p].r /= frameIndex;
-				framebufferCopy[p].g /= frameIndex;
-				framebufferCopy[p].b /= frameIndex;
-				ImageData.push_back(255 * framebufferCopy[p].r);
-				ImageData.push_back(255 * framebufferCopy[p].g);
-				ImageData.push_back(255 * framebufferCopy[p].b);
-				p++;
-			}
-		}
+		ResolveFramebuffer(framebuffer, frameIndex, framebufferCopy, &ImageData);
 
 		// EXPORT TO PNG
-		//stbi_flip_vertically_on_write(1);
-		//stbi_write_png("Frame.png", width, height, 3, ImageData.data(), width * 3);
+		//WriteImage(options.Output, width, height, ImageData);
 
 	    // Printing Info
-	   std::cout << "Width: " << width << std::endl;
-	   std::cout << "Height: " << height << std::endl;
-	   std::cout << "Ray Per Pixel: " << RaysPerPixel << std::endl;
-	   std::cout << "Sphere Amount: " << SphereAmount << std::endl;
-	   std::cout << "Duration: " << frameDuration.count() << " sec" << std::endl;
-       std::cout << std::endl;
+	   PrintReport(rt, options, frameDuration.count());
 
 
 		glClearColor(0, 0, 0, 1.0);
@@ -251,6 +172,10 @@ int main(int argc, char* argv[])
        
     if (wnd.IsOpen())
         wnd.Close();
+    // THE PIXEL COUNTERS ONLY HOLD THE LAST FRAME, SO THE HEATMAP SHOWS THE VIEW AT EXIT
+    if (!options.Heatmap.empty() && WriteHeatmap(rt, options.Heatmap))
+        std::cout << "Wrote " << options.Heatmap << std::endl;
+    FinishTrace(options);
 
     return 0;
 } 
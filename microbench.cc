@@ -0,0 +1,289 @@
+#include "raytracer.h"
+#include "sphere.h"
+#include "material.h"
+#include "pbr.h"
+#include "app.h"
+#include "random.h"
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <string>
+#include <vector>
+
+//------------------------------------------------------------------------------
+/**
+    Microbenchmarks for the kernels a frame spends its time in. The inputs are
+    recorded from paths traced through the seeded demo scene, so every kernel
+    sees the same mix of hits, misses, materials and angles it sees in a
+    render, and then each kernel is timed alone over its batch.
+*/
+
+// one box test the traversal made
+struct BoxTest
+{
+    unsigned RayIndex;
+    unsigned NodeIndex;
+};
+
+// one sphere test the traversal made
+struct SphereTest
+{
+    unsigned RayIndex;
+    Sphere* Target;
+};
+
+// one surface hit that got scattered
+struct SurfaceHit
+{
+    unsigned RayIndex;
+    vec3 Point;
+    vec3 Normal;
+    const Material* Mat;
+    // the random numbers ImportanceSampleGGX_VNDF would have been given
+    float U1, U2;
+    mat4 Basis;
+};
+
+struct RecordedBatch
+{
+    std::vector<Ray> Rays;
+    std::vector<BoxTest> BoxTests;
+    std::vector<SphereTest> SphereTests;
+    std::vector<SurfaceHit> Hits;
+};
+
+struct KernelResult
+{
+    std::string Name;
+    size_t Ops = 0;
+    double NsPerOp = 0;
+    double MopsPerSecond = 0;
+};
+
+// KERNEL RESULTS END UP HERE SO THE OPTIMIZER CAN'T DROP THE CALLS
+static volatile float Sink;
+
+//------------------------------------------------------------------------------
+/**
+    Same walk as Raytracer::TraverseBinary, but writes down every box and
+    sphere test instead of only finding the closest hit
+*/
+static HitResult
+RecordTraversal(const FlatBVH& bvh, Ray& ray, unsigned rayIndex, RecordedBatch& batch, size_t maxTests)
+{
+    HitResult closestHit;
+    const float Origin[3] = { (float)ray.Origin.x, (float)ray.Origin.y, (float)ray.Origin.z };
+    const float InvDir[3] = { (float)ray.InvRayDir.x, (float)ray.InvRayDir.y, (float)ray.InvRayDir.z };
+
+    int StackNode[BVHStackSize];
+    int StackSize = 0;
+    StackNode[StackSize++] = 0;
+    while (StackSize > 0) {
+        int Index = StackNode[--StackSize];
+        const FlatNode& curr = bvh.Nodes[Index];
+        if (batch.BoxTests.size() < maxTests)
+            batch.BoxTests.push_back({ rayIndex, (unsigned)Index });
+        if (!curr.BoxIntersection(Origin, InvDir, closestHit.t))
+            continue;
+
+        if (curr.IsLeaf()) {
+            for (unsigned i = 0; i < curr.Count; i++) {
+                Sphere* sphere = bvh.Primitives[curr.Offset + i];
+                if (batch.SphereTests.size() < maxTests)
+                    batch.SphereTests.push_back({ rayIndex, sphere });
+                HitResult hit = sphere->Intersect(ray, closestHit.t);
+                if (hit.HasValue() && hit.t < closestHit.t) {
+                    closestHit = hit;
+                    closestHit.object = sphere;
+                }
+            }
+        }
+        else {
+            int Near = Index + 1;
+            int Far = curr.Offset;
+            if (ray.sign[curr.Axis])
+                std::swap(Near, Far);
+            StackNode[StackSize++] = Far;
+            StackNode[StackSize++] = Near;
+        }
+    }
+    return closestHit;
+}
+
+//------------------------------------------------------------------------------
+/**
+    Traces width * height camera paths of up to bounces bounces and records
+    every ray, test and hit along them
+*/
+static void
+RecordBatch(Raytracer& rt, unsigned bounces, size_t maxTests, RecordedBatch& batch)
+{
+    for (unsigned y = 0; y < rt.height; y++) {
+        for (unsigned x = 0; x < rt.width; x++) {
+            float u = ((float(x) + RandomFloat()) * (1.0f / rt.width)) * 2.0f - 1.0f;
+            float v = ((float(y) + RandomFloat()) * (1.0f / rt.height)) * 2.0f - 1.0f;
+            vec3 direction = transform(vec3(u, v, -1.0f), rt.frustum);
+            Ray ray(get_position(rt.view), direction);
+
+            for (unsigned n = 0; n <= bounces; n++) {
+                unsigned rayIndex = (unsigned)batch.Rays.size();
+                batch.Rays.push_back(ray);
+                HitResult hit = RecordTraversal(rt.Flat, ray, rayIndex, batch, maxTests);
+                if (!hit.object)
+                    break;
+
+                SurfaceHit surface;
+                surface.RayIndex = rayIndex;
+                surface.Point = hit.p;
+                surface.Normal = hit.normal;
+                surface.Mat = hit.object->material;
+                surface.U1 = RandomFloat();
+                surface.U2 = RandomFloat();
+                surface.Basis = TBN(hit.normal);
+                batch.Hits.push_back(surface);
+
+                ray = hit.object->ScatterRay(ray, hit.p, hit.normal);
+            }
+        }
+    }
+}
+
+//------------------------------------------------------------------------------
+/**
+    Runs the kernel over its whole batch reps times, reports the fastest pass
+    since everything slower than that is noise from the rest of the machine
+*/
+static KernelResult
+TimeKernel(const std::string& name, size_t ops, int reps, const std::function<float()>& pass)
+{
+    double Best = 1e30;
+    for (int i = 0; i < reps; i++) {
+        auto start = std::chrono::high_resolution_clock::now();
+        Sink = pass();
+        auto end = std::chrono::high_resolution_clock::now();
+        Best = std::min(Best, std::chrono::duration<double>(end - start).count());
+    }
+
+    KernelResult result;
+    result.Name = name;
+    result.Ops = ops;
+    result.NsPerOp = ops ? Best * 1e9 / ops : 0;
+    result.MopsPerSecond = Best > 0 ? ops / Best * 1e-6 : 0;
+    return result;
+}
+
+//------------------------------------------------------------------------------
+/**
+*/
+int main(int argc, char* argv[])
+{
+    AppOptions options;
+    options.Width = 128;
+    options.Height = 128;
+    options.SphereAmount = 4096;
+    int reps = 10;
+    size_t maxTests = 4 << 20;
+    std::string jsonPath;
+
+    if (!ParseOptions(argc, argv, options))
+        return 1;
+    for (int i = 0; i + 1 < argc; i++) {
+        if (strcmp(argv[i], "-reps") == 0)
+            reps = std::max(std::stoi(argv[i + 1]), 1);
+        else if (strcmp(argv[i], "-json") == 0)
+            jsonPath = argv[i + 1];
+    }
+
+    // RECORD
+    SeedRandom(1337);
+    std::vector<Color> framebuffer(options.Width * options.Height);
+    Raytracer rt(options.Width, options.Height, framebuffer, 1, options.MaxBounces, 1);
+    std::vector<Sphere*> Spheres = CreateScene(rt, options);
+    SetUpBVH(rt, options, Spheres);
+    mat4 cameraTransform = multiply(rotationy(0), rotationx(0));
+    cameraTransform.m30 = 0;
+    cameraTransform.m31 = 1.0f;
+    cameraTransform.m32 = 10.0f;
+    rt.SetViewMatrix(cameraTransform);
+
+    RecordedBatch batch;
+    RecordBatch(rt, options.MaxBounces, maxTests, batch);
+    std::cout << "Recorded " << batch.Rays.size() << " rays, " << batch.BoxTests.size() << " box tests, "
+              << batch.SphereTests.size() << " sphere tests, " << batch.Hits.size() << " hits" << std::endl;
+
+    // THE OLD BoundingBox TEST TAKES A WHOLE BOX, MAKE ONE PER NODE UP FRONT
+    std::vector<BoundingBox> NodeBoxes(rt.Flat.Nodes.size());
+    for (size_t i = 0; i < NodeBoxes.size(); i++) {
+        const FlatNode& node = rt.Flat.Nodes[i];
+        NodeBoxes[i].Min = vec3(node.Min[0], node.Min[1], node.Min[2]);
+        NodeBoxes[i].Max = vec3(node.Max[0], node.Max[1], node.Max[2]);
+    }
+    struct FloatRay { float Origin[3]; float InvDir[3]; };
+    std::vector<FloatRay> FloatRays(batch.Rays.size());
+    for (size_t i = 0; i < batch.Rays.size(); i++) {
+        for (int k = 0; k < 3; k++) {
+            FloatRays[i].Origin[k] = (float)batch.Rays[i].Origin[k];
+            FloatRays[i].InvDir[k] = (float)batch.Rays[i].InvRayDir[k];
+        }
+    }
+
+    // TIME
+    std::vector<KernelResult> Results;
+    Results.push_back(TimeKernel("Sphere::Intersect", batch.SphereTests.size(), reps, [&]() {
+        float sum = 0;
+        for (const SphereTest& test : batch.SphereTests) {
+            HitResult hit = test.Target->Intersect(batch.Rays[test.RayIndex], FLT_MAX);
+            sum += hit.HasValue() ? hit.t : 0.0f;
+        }
+        return sum;
+    }));
+    Results.push_back(TimeKernel("BoundingBox::BoxIntersection", batch.BoxTests.size(), reps, [&]() {
+        float sum = 0;
+        for (const BoxTest& test : batch.BoxTests)
+            sum += NodeBoxes[test.NodeIndex].BoxIntersection(batch.Rays[test.RayIndex], FLT_MAX);
+        return sum;
+    }));
+    Results.push_back(TimeKernel("FlatNode::BoxIntersection", batch.BoxTests.size(), reps, [&]() {
+        float sum = 0;
+        for (const BoxTest& test : batch.BoxTests) {
+            const FloatRay& ray = FloatRays[test.RayIndex];
+            sum += rt.Flat.Nodes[test.NodeIndex].BoxIntersection(ray.Origin, ray.InvDir, FLT_MAX);
+        }
+        return sum;
+    }));
+    Results.push_back(TimeKernel("BSDF", batch.Hits.size(), reps, [&]() {
+        float sum = 0;
+        for (const SurfaceHit& hit : batch.Hits) {
+            Ray scattered = BSDF(hit.Mat, batch.Rays[hit.RayIndex], hit.Point, hit.Normal);
+            sum += (float)scattered.RayDir.x;
+        }
+        return sum;
+    }));
+    Results.push_back(TimeKernel("ImportanceSampleGGX_VNDF", batch.Hits.size(), reps, [&]() {
+        float sum = 0;
+        for (const SurfaceHit& hit : batch.Hits) {
+            vec3 H = ImportanceSampleGGX_VNDF(hit.U1, hit.U2, hit.Mat->roughness, batch.Rays[hit.RayIndex].RayDir, hit.Basis);
+            sum += (float)H.x;
+        }
+        return sum;
+    }));
+
+    for (const KernelResult& r : Results) {
+        std::cout << r.Name << ": " << r.NsPerOp << " ns/op, " << r.MopsPerSecond << " Mops/s (" << r.Ops << " ops)" << std::endl;
+    }
+
+    if (!jsonPath.empty()) {
+        std::ofstream out(jsonPath);
+        out << "{\n  \"rays\": " << batch.Rays.size() << ",\n  \"kernels\": [\n";
+        for (size_t i = 0; i < Results.size(); i++) {
+            const KernelResult& r = Results[i];
+            out << "    { \"name\": \"" << r.Name << "\", \"ops\": " << r.Ops << ", \"ns_per_op\": " << r.NsPerOp
+                << ", \"mops_per_s\": " << r.MopsPerSecond << " }" << (i + 1 < Results.size() ? "," : "") << "\n";
+        }
+        out << "  ]\n}\n";
+    }
+    return 0;
+}
@@ -0,0 +1,143 @@
+#include "perfcounters.h"
+#include <cerrno>
+#include <cstring>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+//------------------------------------------------------------------------------
+/**
+*/
+PerfCounters::PerfCounters()
+{
+	for (int& fd : fds)
+		fd = -1;
+}
+
+//------------------------------------------------------------------------------
+/**
+*/
+PerfCounters::~PerfCounters()
+{
+	Close();
+}
+
+#ifdef __linux__
+//------------------------------------------------------------------------------
+/**
+*/
+static int
+OpenCounter(uint32_t type, uint64_t config)
+{
+	perf_event_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = type;
+	attr.config = config;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	// ENABLED AND RUNNING TIMES LET Read UNDO MULTIPLEXING
+	attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+	// pid 0 and cpu -1: the calling thread, on whichever cpu it runs
+	return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+#endif
+
+//------------------------------------------------------------------------------
+/**
+*/
+bool
+PerfCounters::Open(std::string& error)
+{
+	Close();
+#ifdef __linux__
+	const uint64_t L1DReadMiss = PERF_COUNT_HW_CACHE_L1D |
+		(PERF_COUNT_HW_CACHE_OP_READ << 8) |
+		(PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+
+	fds[Cycles] = OpenCounter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+	int cyclesError = errno;
+	fds[Instructions] = OpenCounter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+	fds[L1DMisses] = OpenCounter(PERF_TYPE_HW_CACHE, L1DReadMiss);
+	fds[LLCMisses] = OpenCounter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+	fds[BranchMisses] = OpenCounter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES);
+
+	if (!IsOpen()) {
+		error = std::string("perf_event_open failed: ") + strerror(cyclesError);
+		if (cyclesError == EACCES || cyclesError == EPERM)
+			error += " (lower /proc/sys/kernel/perf_event_paranoid to 2 or less, or add CAP_PERFMON)";
+		else if (cyclesError == ENOENT || cyclesError == EOPNOTSUPP)
+			error += " (no hardware PMU, common in virtual machines)";
+		Close();
+		return false;
+	}
+	return true;
+#else
+	error = "hardware performance counters are only supported on Linux";
+	return false;
+#endif
+}
+
+//------------------------------------------------------------------------------
+/**
+*/
+void
+PerfCounters::Close()
+{
+	for (int& fd : fds) {
+#ifdef __linux__
+		if (fd >= 0)
+			close(fd);
+#endif
+		fd = -1;
+	}
+}
+
+//------------------------------------------------------------------------------
+/**
+*/
+bool
+PerfCounters::IsOpen() const
+{
+	return fds[Cycles] >= 0 && fds[Instructions] >= 0;
+}
+
+//------------------------------------------------------------------------------
+/**
+*/
+bool
+PerfCounters::Has(Counter counter) const
+{
+	return fds[counter] >= 0;
+}
+
+//------------------------------------------------------------------------------
+/**
+*/
+PerfCounterValues
+PerfCounters::Read() const
+{
+	uint64_t values[NumCounters] = {};
+#ifdef __linux__
+	for (int i = 0; i < NumCounters; i++) {
+		if (fds[i] < 0)
+			continue;
+		// value, time enabled, time running
+		uint64_t data[3] = {};
+		if (read(fds[i], data, sizeof(data)) != sizeof(data))
+			continue;
+		values[i] = data[2] > 0 && data[2] < data[1] ? (uint64_t)((double)data[0] * data[1] / data[2]) : data[0];
+	}
+#endif
+	PerfCounterValues result;
+	result.Cycles = values[Cycles];
+	result.Instructions = values[Instructions];
+	result.L1DMisses = values[L1DMisses];
+	result.LLCMisses = values[LLCMisses];
+	result.BranchMisses = values[BranchMisses];
+	return result;
+}
@@ -0,0 +1,73 @@
+#pragma once
+#include <cstdint>
+#include <string>
+
+//------------------------------------------------------------------------------
+/**
+	Hardware performance counters of the calling thread, read with
+	perf_event_open on Linux. Anywhere else, or when the kernel refuses
+	(perf_event_paranoid, containers, VMs without a PMU), Open fails and
+	the renderer carries on without them.
+*/
+struct PerfCounterValues
+{
+	uint64_t Cycles = 0;
+	uint64_t Instructions = 0;
+	uint64_t L1DMisses = 0;
+	uint64_t LLCMisses = 0;
+	uint64_t BranchMisses = 0;
+
+	void operator+=(const PerfCounterValues& rhs) {
+		Cycles += rhs.Cycles;
+		Instructions += rhs.Instructions;
+		L1DMisses += rhs.L1DMisses;
+		LLCMisses += rhs.LLCMisses;
+		BranchMisses += rhs.BranchMisses;
+	}
+
+	PerfCounterValues operator-(const PerfCounterValues& rhs) const {
+		PerfCounterValues result;
+		result.Cycles = Cycles - rhs.Cycles;
+		result.Instructions = Instructions - rhs.Instructions;
+		result.L1DMisses = L1DMisses - rhs.L1DMisses;
+		result.LLCMisses = LLCMisses - rhs.LLCMisses;
+		result.BranchMisses = BranchMisses - rhs.BranchMisses;
+		return result;
+	}
+};
+
+class PerfCounters
+{
+public:
+	enum Counter
+	{
+		Cycles,
+		Instructions,
+		L1DMisses,
+		LLCMisses,
+		BranchMisses,
+		NumCounters
+	};
+
+	PerfCounters();
+	~PerfCounters();
+
+	PerfCounters(const PerfCounters&) = delete;
+	PerfCounters& operator=(const PerfCounters&) = delete;
+
+	/// start counting user space events of the calling thread, true if at
+	/// least cycles and instructions could be opened. Error says why not
+	bool Open(std::string& error);
+	/// stop counting
+	void Close();
+	bool IsOpen() const;
+	/// true if the counter could be opened, the others read as 0
+	bool Has(Counter counter) const;
+
+	/// current totals, scaled up if the kernel had to multiplex the counters.
+	/// Can be called from any thread
+	PerfCounterValues Read() const;
+
+private:
+	int fds[NumCounters];
+};
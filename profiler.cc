@@ -0,0 +1,155 @@
+#include "profiler.h"
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace Profiler
+{
+
+// Events of one thread. Only the owning thread writes, so publishing an
+// event is a plain store followed by a release store of Head
+struct Ring
+{
+	Event Events[RingSize];
+	std::atomic<uint64_t> Head{ 0 };
+	unsigned ThreadId = 0;
+	std::string ThreadName;
+};
+
+static std::atomic<bool> Enabled{ false };
+static const std::chrono::steady_clock::time_point Epoch = std::chrono::steady_clock::now();
+
+// RINGS ARE NEVER FREED, A THREAD'S EVENTS OUTLIVE THE THREAD
+static std::mutex RegistryMutex;
+static std::vector<std::unique_ptr<Ring>> Rings;
+
+static thread_local Ring* LocalRing = nullptr;
+static thread_local std::string LocalName;
+
+//------------------------------------------------------------------------------
+/**
+*/
+void
+Enable(bool enable)
+{
+	Enabled.store(enable, std::memory_order_relaxed);
+}
+
+//------------------------------------------------------------------------------
+/**
+*/
+bool
+IsEnabled()
+{
+	return Enabled.load(std::memory_order_relaxed);
+}
+
+//------------------------------------------------------------------------------
+/**
+*/
+uint64_t
+Now()
+{
+	return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - Epoch).count();
+}
+
+//------------------------------------------------------------------------------
+/**
+	The first event of a thread registers its ring, the only time this locks
+*/
+static Ring*
+GetLocalRing()
+{
+	if (!LocalRing) {
+		std::unique_ptr<Ring> ring(new Ring());
+		std::unique_lock<std::mutex> lock(RegistryMutex);
+		ring->ThreadId = (unsigned)Rings.size() + 1;
+		ring->ThreadName = LocalName.empty() ? "Thread " + std::to_string(ring->ThreadId) : LocalName;
+		LocalRing = ring.get();
+		Rings.push_back(std::move(ring));
+	}
+	return LocalRing;
+}
+
+//------------------------------------------------------------------------------
+/**
+*/
+void
+Record(const char* name, uint64_t start, uint64_t end, int64_t arg)
+{
+	Ring* ring = GetLocalRing();
+	uint64_t head = ring->Head.load(std::memory_order_relaxed);
+	ring->Events[head & (RingSize - 1)] = { name, start, end - start, arg };
+	ring->Head.store(head + 1, std::memory_order_release);
+}
+
+//------------------------------------------------------------------------------
+/**
+*/
+void
+SetThreadName(const std::string& name)
+{
+	LocalName = name;
+	if (LocalRing) {
+		std::unique_lock<std::mutex> lock(RegistryMutex);
+		LocalRing->ThreadName = name;
+	}
+}
+
+//------------------------------------------------------------------------------
+/**
+*/
+static void
+WriteJsonString(std::ofstream& out, const char* str)
+{
+	out << '"';
+	for (; *str; str++) {
+		if (*str == '"' || *str == '\\')
+			out << '\\';
+		out << *str;
+	}
+	out << '"';
+}
+
+//------------------------------------------------------------------------------
+/**
+*/
+bool
+WriteChromeTrace(const std::string& path)
+{
+	std::ofstream out(path);
+	if (!out)
+		return false;
+
+	std::unique_lock<std::mutex> lock(RegistryMutex);
+	out << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n";
+	bool first = true;
+	for (const std::unique_ptr<Ring>& ring : Rings) {
+		out << (first ? "" : ",\n") << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << ring->ThreadId << ",\"args\":{\"name\":";
+		WriteJsonString(out, ring->ThreadName.c_str());
+		out << "}}";
+		first = false;
+
+		uint64_t head = ring->Head.load(std::memory_order_acquire);
+		uint64_t begin = head > RingSize ? head - RingSize : 0;
+		for (uint64_t i = begin; i < head; i++) {
+			const Event& event = ring->Events[i & (RingSize - 1)];
+			// TRACE TIMES ARE MICROSECONDS, KEEP THE NANOSECONDS AS FRACTIONS
+			out << ",\n{\"name\":";
+			WriteJsonString(out, event.Name);
+			out << ",\"cat\":\"trayracer\",\"ph\":\"X\",\"pid\":1,\"tid\":" << ring->ThreadId
+				<< ",\"ts\":" << event.Start / 1000 << "." << (event.Start % 1000) / 100 << (event.Start % 100) / 10 << event.Start % 10
+				<< ",\"dur\":" << event.Duration / 1000 << "." << (event.Duration % 1000) / 100 << (event.Duration % 100) / 10 << event.Duration % 10;
+			if (event.Arg != NoArg)
+				out << ",\"args\":{\"value\":" << event.Arg << "}";
+			out << "}";
+		}
+	}
+	out << "\n]}\n";
+	return (bool)out;
+}
+
+} // namespace Profiler
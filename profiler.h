@@ -0,0 +1,83 @@
+#pragma once
+#include <cstdint>
+#include <string>
+
+//------------------------------------------------------------------------------
+/**
+	Scoped timeline profiler. Every thread writes its events into a ring
+	buffer of its own without locking, and WriteChromeTrace dumps all of
+	them as Chrome trace_event JSON for chrome://tracing or Perfetto.
+
+	Recording is off until Profiler::Enable(true), a disabled scope costs
+	one relaxed load. Only the newest RingSize events of a thread are kept.
+*/
+namespace Profiler
+{
+
+struct Event
+{
+	// string literal, only the pointer is stored
+	const char* Name;
+	// nanoseconds since the profiler started
+	uint64_t Start;
+	uint64_t Duration;
+	// shown in the trace as args.value, unless it is NoArg
+	int64_t Arg;
+};
+
+constexpr int64_t NoArg = INT64_MIN;
+constexpr unsigned RingSize = 1 << 16;
+
+/// start or stop recording
+void Enable(bool enable);
+/// true while recording
+bool IsEnabled();
+/// nanoseconds since the profiler started
+uint64_t Now();
+/// add a finished event to the ring of the calling thread
+void Record(const char* name, uint64_t start, uint64_t end, int64_t arg = NoArg);
+/// name the calling thread in the trace
+void SetThreadName(const std::string& name);
+/// write every recorded event as Chrome trace JSON. Call it while the
+/// recording threads are idle, a ring being written to can tear events
+bool WriteChromeTrace(const std::string& path);
+
+//------------------------------------------------------------------------------
+/**
+	Records the time between its construction and destruction
+*/
+class Scope
+{
+public:
+	Scope(const char* name, int64_t arg = NoArg) :
+		name(name),
+		arg(arg),
+		active(IsEnabled()),
+		start(active ? Now() : 0)
+	{
+	}
+
+	~Scope()
+	{
+		if (active)
+			Record(name, start, Now(), arg);
+	}
+
+	Scope(const Scope&) = delete;
+	Scope& operator=(const Scope&) = delete;
+
+private:
+	const char* name;
+	int64_t arg;
+	bool active;
+	uint64_t start;
+};
+
+} // namespace Profiler
+
+#define TRAYRACER_PROFILE_JOIN2(a, b) a##b
+#define TRAYRACER_PROFILE_JOIN(a, b) TRAYRACER_PROFILE_JOIN2(a, b)
+/// time the rest of the enclosing block under name
+#define TRAYRACER_PROFILE_SCOPE(name) Profiler::Scope TRAYRACER_PROFILE_JOIN(profileScope, __LINE__)(name)
+/// same as TRAYRACER_PROFILE_SCOPE, with a number attached to the event
+#define TRAYRACER_PROFILE_SCOPE_ARG(name, arg) Profiler::Scope TRAYRACER_PROFILE_JOIN(profileScope, __LINE__)(name, (int64_t)(arg))
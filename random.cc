@@ -2,52 +2,35 @@
 
 //------------------------------------------------------------------------------
 /**
-    XorShift128 implementation.
+    splitmix64 finalizer, nearby inputs give unrelated outputs
 */
-unsigned
-FastRandom()
+static uint64_t
+Mix64(uint64_t v)
 {
-    // These are predefined to give us the largest
-    // possible sequence of random numbers
-    static unsigned x = 123456789;
-    static unsigned y = 362436069;
-    static unsigned z = 521288629;
-    static unsigned w = 88675123;
-    unsigned t;
-    t = x ^ (x << 11);
-    x = y;
-    y = z;
-    z = w;
-    return w = w ^ (w >> 19) ^ (t ^ (t >> 8));
+    v += 0x9e3779b97f4a7c15ULL;
+    v = (v ^ (v >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    v = (v ^ (v >> 27)) * 0x94d049bb133111ebULL;
+    return v ^ (v >> 31);
 }
 
 //------------------------------------------------------------------------------
 /**
-    Thanks to Nic Werneck (https://xor0110.wordpress.com/2010/09/24/how-to-generate-floating-point-random-numbers-efficiently/)
 */
-float
-RandomFloat()
+void
+SeedRandom(unsigned seed)
 {
-    static union
-    {
-        unsigned int i;
-        float f;
-    } r;
-    r.i = FastRandom() & 0x007fffff | 0x3f800000;
-    return r.f - 1.0f;
+    ThreadRandom.Seed(Mix64(seed), 0);
 }
 
 //------------------------------------------------------------------------------
 /**
+    The pixel and frame pick the starting state, the sample picks the stream,
+    so the samples of one pixel are different sequences and not offsets into
+    the same one.
 */
-float
-RandomFloatNTP()
+void
+SeedPathRandom(uint32_t x, uint32_t y, uint32_t sample, uint32_t frame, uint32_t seed)
 {
-    static union
-    {
-        unsigned int i;
-        float f;
-    } r;
-    r.i = FastRandom() & 0x007fffff | 0x40000000;
-    return r.f - 3.0f;
+    uint64_t Pixel = ((uint64_t)y << 32) | x;
+    ThreadRandom.Seed(Mix64(Pixel ^ Mix64(((uint64_t)seed << 32) | frame)), sample);
 }
@@ -1,12 +1,76 @@
 #pragma once
+#include <cstdint>
+#include <cstring>
 
-/// Produces an xorshift128 pseudo random number.
-unsigned FastRandom();
+//------------------------------------------------------------------------------
+/**
+    PCG32 (O'Neill, pcg-random.org). A 64 bit LCG whose output is permuted
+    down to 32 bits. Every stream is a sequence of its own, so generators
+    seeded with different streams never walk into each other.
+*/
+struct Pcg32
+{
+    uint64_t State = 0x853c49e6748fea9bULL;
+    uint64_t Inc = 0xda3e39cb94b95bdbULL;
 
-/// Produces an xorshift128 psuedo based floating point random number in range 0..1
-/// Note that this is not a truly random random number generator
-float RandomFloat();
+    void Seed(uint64_t seed, uint64_t stream)
+    {
+        State = 0;
+        Inc = (stream << 1u) | 1u;
+        Next();
+        State += seed;
+        Next();
+    }
 
-/// Produces an xorshift128 psuedo based floating point random number in range -1..1
-/// Note that this is not a truly random random number generator
-float RandomFloatNTP();
\ No newline at end of file
+    uint32_t Next()
+    {
+        uint64_t old = State;
+        State = old * 6364136223846793005ULL + Inc;
+        uint32_t xorshifted = (uint32_t)(((old >> 18u) ^ old) >> 27u);
+        uint32_t rot = (uint32_t)(old >> 59u);
+        return (xorshifted >> rot) | (xorshifted << ((-rot) & 31));
+    }
+};
+
+// EVERY THREAD DRAWS FROM ITS OWN GENERATOR, THE RENDERER RESEEDS IT FOR EVERY CAMERA PATH
+inline thread_local Pcg32 ThreadRandom;
+
+/// Produces a PCG32 pseudo random number from the calling thread's generator.
+inline unsigned
+FastRandom()
+{
+    return ThreadRandom.Next();
+}
+
+//------------------------------------------------------------------------------
+/**
+    Floating point random number in range 0..1, made by putting random bits in
+    the mantissa of a float in 1..2.
+    Thanks to Nic Werneck (https://xor0110.wordpress.com/2010/09/24/how-to-generate-floating-point-random-numbers-efficiently/)
+*/
+inline float
+RandomFloat()
+{
+    unsigned i = (FastRandom() >> 9) | 0x3f800000;
+    float f;
+    memcpy(&f, &i, sizeof(f));
+    return f - 1.0f;
+}
+
+/// Floating point random number in range -1..1, the same trick on a float in 2..4
+inline float
+RandomFloatNTP()
+{
+    unsigned i = (FastRandom() >> 9) | 0x40000000;
+    float f;
+    memcpy(&f, &i, sizeof(f));
+    return f - 3.0f;
+}
+
+/// Restarts the calling thread's sequence from a state derived from seed, for reproducible scenes.
+void SeedRandom(unsigned seed);
+
+/// Seeds the calling thread's generator for one camera path. The numbers the path
+/// draws then only depend on its pixel, sample, frame and the render seed, not on
+/// the thread tracing it
+void SeedPathRandom(uint32_t x, uint32_t y, uint32_t sample, uint32_t frame, uint32_t seed = 0);
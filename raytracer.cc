@@ -1,60 +1,233 @@
 #include "raytracer.h"
 #include <chrono>
-#include <random>
 #include <thread>
 #include <future>
 #include <atomic>
 #include <iostream>
 
+thread_local int Raytracer::WorkerIndex = -1;
+
 //------------------------------------------------------------------------------
 /**
 */
-Raytracer::Raytracer(unsigned w, unsigned h, std::vector<Color>& frameBuffer, unsigned rpp, unsigned bounces) :
+Raytracer::Raytracer(unsigned w, unsigned h, std::vector<Color>& frameBuffer, unsigned rpp, unsigned bounces, unsigned threads) :
     frameBuffer(frameBuffer),
     rpp(rpp),
     bounces(bounces),
     width(w),
     height(h)
 {
-    SpawnThread();
+    SpawnThread(threads ? threads : std::thread::hardware_concurrency());
 }
 
 Raytracer::~Raytracer() {
     Stop();
+    delete MainNode;
 }
 //------------------------------------------------------------------------------
 /**
 */
 
 void Raytracer::SetUpNode(BoundingBox Box, std::vector<Sphere*> Spheres) {
-    MainNode = new Node(Box, Spheres);
+    TRAYRACER_PROFILE_SCOPE("BVHSetUp");
+    BVHTaskRunner Runner;
+    Runner.Run = [this](std::vector<std::function<void()>>& Tasks) { RunTasks(Tasks); };
+    Runner.Workers = (int)ThreadCounts;
+
+    delete MainNode;
+    MainNode = nullptr;
+
+    uint64_t SceneHash = 0;
+    bBVHFromCache = false;
+    if (!BVHCacheDir.empty()) {
+        TRAYRACER_PROFILE_SCOPE("BVHCacheLoad");
+        SceneHash = HashScene(Spheres, BuildSettings);
+        bBVHFromCache = LoadBVHCache(BVHCachePath(BVHCacheDir, SceneHash), SceneHash, Spheres, Flat);
+    }
+
+    if (bBVHFromCache) {
+        // NOTHING TO BUILD
+    }
+    else if (BuildSettings.Builder == BVHBuilder::LBVH) {
+        TRAYRACER_PROFILE_SCOPE("BVHBuildLBVH");
+        LBVHBuilder Builder;
+        Builder.Build(Flat, Spheres, BuildSettings, &Runner);
+    }
+    else {
+        {
+            TRAYRACER_PROFILE_SCOPE("BVHBuildSAH");
+            MainNode = new Node(Box, Spheres, BuildSettings, &Runner);
+        }
+        TRAYRACER_PROFILE_SCOPE("BVHFlatten");
+        Flat.Flatten(MainNode, Spheres);
+    }
+    if (!BVHCacheDir.empty() && !bBVHFromCache) {
+        TRAYRACER_PROFILE_SCOPE("BVHCacheSave");
+        if (!SaveBVHCache(BVHCachePath(BVHCacheDir, SceneHash), SceneHash, Flat))
+            std::cout << "Could not write BVH cache to " << BVHCacheDir << std::endl;
+    }
+    {
+        TRAYRACER_PROFILE_SCOPE("BVHCollapse");
+        if (this->BVHWidth == 4)
+            Wide4.Collapse(Flat);
+        else if (this->BVHWidth == 8)
+            Wide8.Collapse(Flat);
+    }
+    if (this->BVHWidth == 8 && !WideBVHUsesAVX()) {
+        static std::once_flag Warned;
+        std::call_once(Warned, [] {
+            std::cout << "BVH Width 8: no AVX on this CPU or in this build, child boxes are tested one at a time" << std::endl;
+        });
+    }
+
+    BVHSpheres = std::move(Spheres);
+    BuiltSAHCost = Flat.SAHCost(BuildSettings.TraversalCost, BuildSettings.IntersectionCost);
+}
+
+bool
+Raytracer::UpdateBVH() {
+    TRAYRACER_PROFILE_SCOPE("BVHRefit");
+    Flat.Refit();
+    float Cost = Flat.SAHCost(BuildSettings.TraversalCost, BuildSettings.IntersectionCost);
+    if (Cost > BuiltSAHCost * RebuildThreshold) {
+        SetUpNode(BoundingBox(), BVHSpheres);
+        return true;
+    }
+
+    // THE WIDE NODES COPY THEIR BOUNDS, COLLAPSING AGAIN IS JUST AS CHEAP AS REFITTING THEM
+    if (this->BVHWidth == 4)
+        Wide4.Collapse(Flat);
+    else if (this->BVHWidth == 8)
+        Wide8.Collapse(Flat);
+    return false;
 }
 
 unsigned int 
-Raytracer::AssignJob()
+Raytracer::AssignJob(Color* Target)
 {
+    FrameLock Lock(*this);
+    if (!Target)
+        Target = frameBuffer.data();
+    TRAYRACER_STAT(ResetTraversalStats());
+    TRAYRACER_PROFILE_SCOPE("Frame");
+    FrameIndex++;
+
+    std::vector<PerfCounterValues> PerfBefore;
+    const RayCounters RaysBefore = RayStats();
+    // A FRAME RUNNING ON A WORKER SKIPS THEM, OPENING THEM NEEDS EVERY WORKER AT ONCE
+    if (bPerfCounters && WorkerIndex < 0) {
+        if (WorkerPerf.empty() && PerfError.empty())
+            OpenPerfCounters();
+        for (const std::unique_ptr<PerfCounters>& Counters : WorkerPerf)
+            PerfBefore.push_back(Counters->Read());
+    }
+
     // ThreadPool
-    JobsCompleted.store(0);
-    int NumChunk = 50;
-    int ChunkSize = height / NumChunk;
+    const unsigned Size = TileSize ? TileSize : ChooseTileSize(width, height, ThreadCounts);
+    if (Tiles.empty() || Size != TilesBuiltSize || TileOrdering != TilesBuiltOrder) {
+        Tiles = MakeTiles(width, height, Size, TileOrdering);
+        TilesBuiltSize = Size;
+        TilesBuiltOrder = TileOrdering;
+    }
 
-    for (int i = 0; i < NumChunk; i++) {
-        float my = i * ChunkSize;
-        float mx = (i == NumChunk - 1) ? height : (i + 1) * ChunkSize;
-        QueueChunk(vec2(my, mx));
+    std::vector<std::function<void()>> Tasks;
+    Tasks.reserve(Tiles.size());
+    for (size_t i = 0; i < Tiles.size(); i++) {
+        Tasks.push_back([this, i, Target]() {
+            TRAYRACER_PROFILE_SCOPE_ARG("Tile", i);
+            const Tile& tile = Tiles[i];
+            RayTraceTile(tile.MinX, tile.MinY, tile.MaxX, tile.MaxY, Target);
+        });
+    }
+    // THE CALLER RENDERS TILES TOO, EXCEPT WHEN ONLY THE WORKERS HAVE COUNTERS OPEN
+    RunTasks(Tasks, PerfBefore.empty());
+
+    FrameRays = RayStats() - RaysBefore;
+    if (!PerfBefore.empty()) {
+        FramePerf.resize(WorkerPerf.size());
+        for (size_t i = 0; i < WorkerPerf.size(); i++)
+            FramePerf[i] = WorkerPerf[i]->Read() - PerfBefore[i];
+        FramePerfRays = FrameRays.CameraRays;
     }
 
-    while (JobsCompleted < NumChunk) {
-        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    return (unsigned)FrameRays.CameraRays;
+}
+
+//------------------------------------------------------------------------------
+/**
+*/
+RayCounters
+Raytracer::RayStats() const
+{
+    RayCounters Total = CallerRays.Load();
+    for (unsigned i = 0; i < ThreadCounts; i++)
+        Total += WorkerRays[i].Counters;
+    return Total;
+}
+
+//------------------------------------------------------------------------------
+/**
+*/
+void
+Raytracer::PrintRayStats(float frameDuration) const
+{
+    const double Seconds = std::max((double)frameDuration, 1e-9);
+    std::cout << "Rays: " << FrameRays.Rays() << " (" << FrameRays.CameraRays << " camera, "
+              << FrameRays.Bounces << " bounces)" << std::endl;
+    std::cout << "Terminated Paths: " << FrameRays.TerminatedPaths << " of " << FrameRays.CameraRays << " hit the bounce limit" << std::endl;
+    std::cout << "Throughput: " << FrameRays.Rays() / Seconds * 1e-6 << " Mrays/s ("
+              << FrameRays.CameraRays / Seconds * 1e-6 << " M camera rays/s)" << std::endl;
+}
+
+std::future<unsigned>
+Raytracer::AssignJobAsync(Color* Target)
+{
+    return QueueFrameJob([this, Target]() { return AssignJob(Target); });
+}
+
+//------------------------------------------------------------------------------
+/**
+    Only idle workers come here, never one helping with a frame. The job runs
+    with FrameMutex held, so waiting for it instead could park the worker that
+    frame's owner needs
+*/
+bool
+Raytracer::RunFrameJob()
+{
+    if (FrameJobCount.load() == 0)
+        return false;
+
+    std::function<void()> Job;
+    {
+        std::unique_lock<std::mutex> lock(QueueMutex);
+        if (FrameJobs.empty() || !FrameMutex.try_lock())
+            return false;
+        Job = std::move(FrameJobs.front());
+        FrameJobs.pop_front();
+        FrameJobCount.store(FrameJobs.size());
     }
+    FrameLock Lock(*this, std::adopt_lock);
+    Job();
+    return true;
+}
 
-    return RayNum;
+//------------------------------------------------------------------------------
+/**
+*/
+void
+Raytracer::ReleaseFrame()
+{
+    FrameMutex.unlock();
+    // A WORKER MAY HAVE FOUND THE MUTEX TAKEN AND GONE TO SLEEP
+    if (FrameJobCount.load() != 0)
+        WakeWorkers();
 }
 
 Color 
 Raytracer::GetColor2(int x, int y){
      Color color;
-    for (int i = 0; i < rpp; ++i) {
+    for (unsigned i = 0; i < rpp; ++i) {
+        SeedPathRandom(x, y, i, FrameIndex, Seed);
         float u = ((float(x) + RandomFloat()) * (1.0f / width)) * 2.0f - 1.0f;
         float v = ((float(y) + RandomFloat()) * (1.0f / height)) * 2.0f - 1.0f;
         vec3 direction = vec3(u, v, -1.0f);
@@ -66,7 +239,7 @@ Raytracer::GetColor2(int x, int y){
 }
 
 
-Color Raytracer::GetColor(float u, float v, int x, int y) {
+Color Raytracer::GetColor(float u, float v) {
 
 	vec3 direction = vec3(u, v, -1.0f);
 	direction = transform(direction, this->frustum);
@@ -78,12 +251,12 @@ Color Raytracer::GetColor(float u, float v, int x, int y) {
 }
 
 void
-Raytracer::AssignColor(Color &color, int x, int y) {
+Raytracer::AssignColor(Color &color, Color* Target, int x, int y) {
 	color.r /= this->rpp;
 	color.g /= this->rpp;
 	color.b /= this->rpp;
 
-	this->frameBuffer[y * this->width + x] += color;
+	Target[y * this->width + x] += color;
 }
 
 std::pair<int, int> Raytracer::indexToXY(size_t index) const {
@@ -99,20 +272,19 @@ std::pair<int, int> Raytracer::indexToXY(size_t index) const {
 unsigned int 
 Raytracer::Raytrace()
 {
-    static int leet = 1337;
-    std::mt19937 generator (leet++);
-    std::uniform_real_distribution<float> dis(0.0f, 1.0f);
     unsigned int RayNum = 0;
+    FrameIndex++;
 
-    for (int x = 0; x < this->width; ++x)
+    for (unsigned x = 0; x < this->width; ++x)
     {
-        for (int y = 0; y < this->height; ++y)
+        for (unsigned y = 0; y < this->height; ++y)
         {
             Color color;
-            for (int i = 0; i < this->rpp; ++i)
+            for (unsigned i = 0; i < this->rpp; ++i)
             {
-                float u = ((float(x + dis(generator)) * (1.0f / this->width)) * 2.0f) - 1.0f;
-                float v = ((float(y + dis(generator)) * (1.0f / this->height)) * 2.0f) - 1.0f;
+                SeedPathRandom(x, y, i, FrameIndex, Seed);
+                float u = ((float(x) + RandomFloat()) * (1.0f / this->width)) * 2.0f - 1.0f;
+                float v = ((float(y) + RandomFloat()) * (1.0f / this->height)) * 2.0f - 1.0f;
 
                 vec3 direction = vec3(u, v, -1.0f);
                 direction = transform(direction, this->frustum);
@@ -145,6 +317,9 @@ Raytracer::TracePath(Ray &ray, unsigned n)
     Object* hitObject = nullptr;
     Color color;
     float distance = FLT_MAX;
+    TRAYRACER_STAT(if (n > 0) ThreadCounters.Bounces++);
+    if (n > 0)
+        ThreadRays.Bounces++;
 
     if (BVHRaycast(ray, hitPoint, hitNormal, hitObject, distance, this->objects))
     {
@@ -156,6 +331,7 @@ Raytracer::TracePath(Ray &ray, unsigned n)
 
         if (n == this->bounces)
         {
+            ThreadRays.TerminatedPaths++;
             return {0,0,0};
         }
     }
@@ -168,28 +344,15 @@ Raytracer::TracePath(Ray &ray, unsigned n)
 
 bool
 Raytracer::BVHRaycast(Ray &ray, vec3& hitPoint, vec3& hitNormal, Object*& hitObject, 
-    float& distance, std::vector<Sphere*> const &world)
+    float& distance, std::vector<Sphere*> const & /*world, the BVH already holds it*/)
 {
     HitResult closestHit;
-    std::stack<Node*> StackNode;
-    StackNode.push(this->MainNode);
-    Node* curr;
-    while (!StackNode.empty()) {
-        curr = StackNode.top();
-        StackNode.pop();
-            
-        // CONTINUE IF IT DIDN'T HIT THE BOUNDING BOX
-        if (!curr->bounds.BoxIntersection(ray, closestHit.t))
-            continue;
-
-        // ITERATE THROUGHT THE LEAF NODE
-        if (curr->IsLeaf()) 
-            this->HitTest(curr, closestHit, ray);
-        else {
-			StackNode.push(curr->ChildA);
-			StackNode.push(curr->ChildB);
-        }
-    }
+    if (this->BVHWidth == 8)
+        TraverseWide(this->Wide8, ray, closestHit);
+    else if (this->BVHWidth == 4)
+        TraverseWide(this->Wide4, ray, closestHit);
+    else
+        TraverseBinary(ray, closestHit);
 
     hitPoint = closestHit.p;
     hitNormal = closestHit.normal;
@@ -201,86 +364,423 @@ Raytracer::BVHRaycast(Ray &ray, vec3& hitPoint, vec3& hitNormal, Object*& hitObj
     return false;
 }
 
+//------------------------------------------------------------------------------
+/**
+*/
+void
+Raytracer::TraverseBinary(Ray& ray, HitResult& closestHit)
+{
+    if (Flat.Empty())
+        return;
+
+    const float Origin[3] = { (float)ray.Origin.x, (float)ray.Origin.y, (float)ray.Origin.z };
+    const float InvDir[3] = { (float)ray.InvRayDir.x, (float)ray.InvRayDir.y, (float)ray.InvRayDir.z };
+
+    int StackNode[BVHStackSize];
+    int StackSize = 0;
+    StackNode[StackSize++] = 0;
+    while (StackSize > 0) {
+        int Index = StackNode[--StackSize];
+        const FlatNode& curr = Flat.Nodes[Index];
+
+        // CONTINUE IF IT DIDN'T HIT THE BOUNDING BOX
+        TRAYRACER_STAT(ThreadCounters.BoxTests++);
+        if (!curr.BoxIntersection(Origin, InvDir, closestHit.t))
+            continue;
+        TRAYRACER_STAT(ThreadCounters.NodesVisited++);
+
+        // ITERATE THROUGHT THE LEAF NODE
+        if (curr.IsLeaf())
+            this->HitTest(curr.Offset, curr.Count, closestHit, ray);
+        else {
+            // FIRST CHILD IS STORED RIGHT AFTER ITS PARENT AND HOLDS THE LOWER
+            // HALF OF THE SPLIT AXIS, VISIT THE ONE FACING THE RAY FIRST SO
+            // closestHit.t SHRINKS BEFORE THE FAR SIDE IS TESTED
+            int Near = Index + 1;
+            int Far = curr.Offset;
+            if (ray.sign[curr.Axis])
+                std::swap(Near, Far);
+            StackNode[StackSize++] = Far;
+            StackNode[StackSize++] = Near;
+        }
+    }
+}
+
+//------------------------------------------------------------------------------
+/**
+    Same as TraverseBinary, but one SIMD slab test covers all children of a
+    node. Hit children are visited closest entry first, and remember their
+    entry distance so they can be culled when popped after a closer hit.
+*/
+template<int N>
+void
+Raytracer::TraverseWide(const WideBVH<N>& bvh, Ray& ray, HitResult& closestHit)
+{
+    if (bvh.Empty())
+        return;
 
-void 
-Raytracer::HitTest(Node*& node, HitResult& closestHit, Ray ray) {
+    WideRay wideRay;
+    for (int i = 0; i < 3; i++) {
+        wideRay.Origin[i] = (float)ray.Origin[i];
+        wideRay.InvDir[i] = (float)ray.InvRayDir[i];
+    }
+
+    struct StackEntry { int Index; float tEntry; };
+    StackEntry StackNode[BVHStackSize * N];
+    int StackSize = 0;
+    StackNode[StackSize++] = { 0, 0.0f };
+    while (StackSize > 0) {
+        StackEntry entry = StackNode[--StackSize];
+        if (entry.tEntry > closestHit.t)
+            continue;
+        const WideNode<N>& curr = bvh.Nodes[entry.Index];
+        TRAYRACER_STAT(ThreadCounters.NodesVisited++);
+        TRAYRACER_STAT(ThreadCounters.BoxTests += curr.NumChildren);
+
+        float tEntry[N];
+        int Mask = IntersectChildren(curr, wideRay, closestHit.t, tEntry);
+        Mask &= (1 << curr.NumChildren) - 1;
+
+        // SORT THE HIT CHILDREN FAR TO NEAR, N IS SMALL SO INSERTION SORT IT IS
+        int Order[N];
+        int NumHit = 0;
+        for (; Mask; Mask &= Mask - 1) {
+            int lane = 0;
+            while (!(Mask & (1 << lane)))
+                lane++;
+            int j = NumHit++;
+            while (j > 0 && tEntry[Order[j - 1]] < tEntry[lane]) {
+                Order[j] = Order[j - 1];
+                j--;
+            }
+            Order[j] = lane;
+        }
+
+        for (int i = 0; i < NumHit; i++) {
+            int lane = Order[i];
+            if (curr.Count[lane] > 0)
+                continue;
+            StackNode[StackSize++] = { curr.Child[lane], tEntry[lane] };
+        }
+        // LEAVES ARE TESTED RIGHT AWAY, NEAREST FIRST
+        for (int i = NumHit - 1; i >= 0; i--) {
+            int lane = Order[i];
+            if (curr.Count[lane] > 0 && tEntry[lane] <= closestHit.t)
+                this->HitTest(curr.Child[lane], curr.Count[lane], closestHit, ray);
+        }
+    }
+}
+
+//------------------------------------------------------------------------------
+/**
+*/
+void
+Raytracer::HitTest(unsigned First, unsigned Count, HitResult& closestHit, Ray& ray) {
     HitResult hit;
-    for (Sphere* sphere : node->spheres)
+    TRAYRACER_STAT(ThreadCounters.SphereTests += Count);
+    Sphere* const* Primitives = Flat.Primitives.data() + First;
+    for (unsigned i = 0; i < Count; i++)
     {
-        hit = sphere->Intersect(ray, closestHit.t);
+        hit = Primitives[i]->Intersect(ray, closestHit.t);
         if (hit.HasValue())
         {
             if (hit.t < closestHit.t) {
                 closestHit = hit;
-                closestHit.object = sphere;
+                closestHit.object = Primitives[i];
             }
         }
     }
 }
 
-void Raytracer::RayTraceChunk(vec2 &Chunk) {
-    size_t MinY = Chunk.x;
-    size_t MaxY = Chunk.y;
-
-    static int leet = 1337;
-    std::mt19937 generator(leet++);
-    std::uniform_real_distribution<float> dis(0.0f, 1.0f);
-
-    for (int y = MinY; y < MaxY; y++) {
-        for (int x = 0; x < this->width;x++) {
-            Color color;
-            for (int i = 0; i < this->rpp; i++) {
-                float u = ((float(x) + dis(generator)) * (1.0f / this->width)) * 2.0f - 1.0f;
-                float v = ((float(y) + dis(generator)) * (1.0f / this->height)) * 2.0f - 1.0f;
+void Raytracer::RayTraceTile(unsigned MinX, unsigned MinY, unsigned MaxX, unsigned MaxY, Color* Target) {
+#if TRAYRACER_STATS
+    const TraversalCounters TileStart = ThreadCounters;
+#endif
+    const RayCounters RaysStart = ThreadRays;
+    // SAMPLES SUM UP IN A BUFFER OF THE THREAD'S OWN, Target IS ONLY WRITTEN ONCE PER PIXEL
+    // WHEN THE TILE IS DONE, SO NEIGHBOURING TILES DON'T FIGHT OVER ITS CACHE LINES
+    static thread_local std::vector<Color> TileColors;
+    const unsigned TileWidth = MaxX - MinX;
+    TileColors.assign((size_t)TileWidth * (MaxY - MinY), Color());
+
+    for (unsigned y = MinY; y < MaxY; y++) {
+        for (unsigned x = MinX; x < MaxX; x++) {
+            Color& color = TileColors[(size_t)(y - MinY) * TileWidth + (x - MinX)];
+#if TRAYRACER_STATS
+            const TraversalCounters PixelStart = ThreadCounters;
+#endif
+            for (unsigned i = 0; i < this->rpp; i++) {
+                TRAYRACER_STAT(ThreadCounters.Paths++);
+                // THE PATH DRAWS THE SAME NUMBERS WHICHEVER THREAD TRACES IT
+                SeedPathRandom(x, y, i, FrameIndex, Seed);
+                float u = ((float(x) + RandomFloat()) * (1.0f / this->width)) * 2.0f - 1.0f;
+                float v = ((float(y) + RandomFloat()) * (1.0f / this->height)) * 2.0f - 1.0f;
 
                 vec3 direction = vec3(u, v, -1.0f);
                 direction = transform(direction, this->frustum);
 
                 Ray ray = Ray(get_position(this->view), direction);
                 color += this->TracePath(ray, 0);
-                AssignColor(color, x, y);
-                this->RayNum++;
+                ThreadRays.CameraRays++;
             }
+#if TRAYRACER_STATS
+            TraversalCounters Pixel = ThreadCounters - PixelStart;
+            PixelCounters& Out = PixelStats[y * this->width + x];
+            Out.NodesVisited = (uint32_t)Pixel.NodesVisited;
+            Out.BoxTests = (uint32_t)Pixel.BoxTests;
+            Out.SphereTests = (uint32_t)Pixel.SphereTests;
+            Out.Bounces = (uint32_t)Pixel.Bounces;
+#endif
         }
     }
-    JobsCompleted.fetch_add(1);
+
+    for (unsigned y = MinY; y < MaxY; y++) {
+        for (unsigned x = MinX; x < MaxX; x++)
+            AssignColor(TileColors[(size_t)(y - MinY) * TileWidth + (x - MinX)], Target, x, y);
+    }
+    if (WorkerIndex < 0)
+        CallerRays.Add(ThreadRays - RaysStart);
+    else
+        WorkerRays[WorkerIndex].Counters += ThreadRays - RaysStart;
+#if TRAYRACER_STATS
+    // ONE LOCK PER TILE, THE COUNTERS THEMSELVES STAY THREAD LOCAL
+    std::unique_lock<std::mutex> lock(StatsMutex);
+    ThreadStats[WorkerIndex < 0 ? ThreadCounts : WorkerIndex] += ThreadCounters - TileStart;
+#endif
+}
+
+//------------------------------------------------------------------------------
+/**
+*/
+TraversalCounters
+Raytracer::TraversalStats() const
+{
+    TraversalCounters Total;
+    for (const TraversalCounters& Thread : ThreadStats)
+        Total += Thread;
+    return Total;
+}
+
+//------------------------------------------------------------------------------
+/**
+*/
+void
+Raytracer::ResetTraversalStats()
+{
+    ThreadStats.assign(ThreadCounts + 1, TraversalCounters());
+    PixelStats.assign(width * height, PixelCounters());
+}
+
+//------------------------------------------------------------------------------
+/**
+*/
+void
+Raytracer::PrintTraversalStats() const
+{
+#if TRAYRACER_STATS
+    TraversalCounters Total = TraversalStats();
+    double Rays = (double)std::max<uint64_t>(Total.Paths + Total.Bounces, 1);
+    double Paths = (double)std::max<uint64_t>(Total.Paths, 1);
+    std::cout << "Traversal: " << Total.Paths << " paths, " << Total.Paths + Total.Bounces << " rays" << std::endl;
+    std::cout << "  Nodes Visited: " << Total.NodesVisited << " (" << Total.NodesVisited / Rays << " per ray)" << std::endl;
+    std::cout << "  Box Tests: " << Total.BoxTests << " (" << Total.BoxTests / Rays << " per ray)" << std::endl;
+    std::cout << "  Sphere Tests: " << Total.SphereTests << " (" << Total.SphereTests / Rays << " per ray)" << std::endl;
+    std::cout << "  Bounce Depth: " << Total.Bounces / Paths << " per path" << std::endl;
+    for (size_t i = 0; i < ThreadStats.size(); i++) {
+        if (ThreadStats[i].Paths == 0)
+            continue;
+        std::cout << "  Thread " << (i == ThreadCounts ? std::string("caller") : std::to_string(i)) << ": "
+                  << ThreadStats[i].Paths << " paths, " << ThreadStats[i].NodesVisited << " nodes" << std::endl;
+    }
+#endif
 }
 
 
+//------------------------------------------------------------------------------
+/**
+    Pushes the batch onto the deque of the calling thread and wakes the
+    workers to steal from it. The caller pops its own tasks back off the
+    other end until none are left anywhere, then sleeps on the latch for
+    the ones still running elsewhere
+*/
+void
+Raytracer::RunTasks(std::vector<std::function<void()>>& Tasks, bool bHelp) {
+    if (Tasks.empty())
+        return;
+
+    // A THREAD FROM OUTSIDE THE POOL BORROWS THE LAST DEQUE FOR THE WHOLE BATCH
+    std::unique_lock<std::mutex> CallerLock(CallerMutex, std::defer_lock);
+    if (WorkerIndex < 0)
+        CallerLock.lock();
+    const unsigned Slot = WorkerIndex < 0 ? ThreadCounts : (unsigned)WorkerIndex;
+
+    Latch Done((int)Tasks.size());
+    std::vector<PoolTask> Batch(Tasks.size());
+    // PUSHED BACKWARDS, THIEVES TAKE FROM THE TOP AND GET THE TASKS IN THEIR ORDER
+    for (size_t i = Tasks.size(); i-- > 0;) {
+        Batch[i] = { &Tasks[i], &Done };
+        Deques[Slot]->Push(&Batch[i]);
+    }
+    WakeWorkers();
+
+    if (bHelp) {
+        PoolTask* Task;
+        while (!Done.TryWait() && FindTask(Slot, Task)) {
+            TRAYRACER_PROFILE_SCOPE("Task");
+            (*Task->Func)();
+            Task->Done->CountDown();
+        }
+    }
+    TRAYRACER_PROFILE_SCOPE("BatchWait");
+    Done.Wait();
+}
+
 void
-Raytracer::QueueChunk(vec2& Chunk) {
+Raytracer::WakeWorkers() {
     {
+        // UNDER THE LOCK, A WORKER BETWEEN CHECKING THE EPOCH AND SLEEPING CAN'T MISS IT
         std::unique_lock<std::mutex> lock(QueueMutex);
-        ChunkInfo.push(Chunk);
+        WakeEpoch.fetch_add(1);
+    }
+    Mutex.notify_all();
+}
+
+bool
+Raytracer::FindTask(unsigned Slot, PoolTask*& Task) {
+    if (Deques[Slot]->Pop(Task))
+        return true;
+    const unsigned Count = (unsigned)Deques.size();
+    for (unsigned i = 1; i < Count; i++) {
+        if (Deques[(Slot + i) % Count]->Steal(Task))
+            return true;
     }
-    Mutex.notify_one();
+    return false;
 }
 
 void 
-Raytracer::SpawnThread() {
-    int Cores = std::thread::hardware_concurrency();
-     //Cores  = 1;
-    for (int i = 0; i < Cores; i++) {
-        Threads.emplace_back(&Raytracer::ThreadLoop, this);
+Raytracer::SpawnThread(unsigned Count) {
+    Count = std::max(Count, 1u);
+    // THE DEQUES HAVE TO EXIST BEFORE THE FIRST WORKER GOES LOOKING
+    for (unsigned i = 0; i <= Count; i++)
+        Deques.emplace_back(new WorkStealingDeque<PoolTask*>());
+    WorkerRays.reset(new PaddedRayCounters[Count]);
+    for (unsigned i = 0; i < Count; i++) {
+        Threads.emplace_back(&Raytracer::ThreadLoop, this, (int)i);
         ThreadCounts++;
     }
+    ResetTraversalStats();
 }
 
 void 
-Raytracer::ThreadLoop() {
+Raytracer::ThreadLoop(int Index) {
+    WorkerIndex = Index;
+    Profiler::SetThreadName("Worker " + std::to_string(Index));
+    const int SpinRounds = 64;
+    int Idle = 0;
     while (true) {
-        vec2 Chunk;
-        {
-            std::unique_lock<std::mutex> lock(QueueMutex);
-            Mutex.wait(lock, [this] {
-                return !ChunkInfo.empty() || bShouldTerminate;
-                });
-            if (bShouldTerminate)
-                return;
-            Chunk = ChunkInfo.front();
-            ChunkInfo.pop();
+        // READ BEFORE LOOKING, A PUSH AFTER THE LOOK THEN ALWAYS CHANGES IT
+        const uint64_t Epoch = WakeEpoch.load();
+        PoolTask* Task;
+        if (FindTask((unsigned)Index, Task)) {
+            Idle = 0;
+            TRAYRACER_PROFILE_SCOPE("Task");
+            (*Task->Func)();
+            Task->Done->CountDown();
+            continue;
+        }
+        if (RunFrameJob()) {
+            Idle = 0;
+            continue;
+        }
+        if (++Idle < SpinRounds) {
+            std::this_thread::yield();
+            continue;
+        }
+
+        TRAYRACER_PROFILE_SCOPE("Idle");
+        std::unique_lock<std::mutex> lock(QueueMutex);
+        Mutex.wait(lock, [this, Epoch] {
+            return WakeEpoch.load() != Epoch || bShouldTerminate;
+            });
+        if (bShouldTerminate)
+            return;
+        Idle = 0;
+    }
+}
+
+//------------------------------------------------------------------------------
+/**
+    Every task waits until all of them have started, so no worker can pick
+    up a second one and each worker runs Func exactly once
+*/
+void
+Raytracer::RunOnEveryWorker(const std::function<void(int)>& Func) {
+    const int Count = (int)ThreadCounts;
+    std::atomic<int> Started(0);
+    std::vector<std::function<void()>> Tasks;
+    for (int i = 0; i < Count; i++) {
+        Tasks.push_back([&Started, &Func, Count]() {
+            Started.fetch_add(1);
+            while (Started.load() < Count)
+                std::this_thread::yield();
+            Func(WorkerIndex);
+        });
+    }
+    // THE CALLER MUST NOT TAKE ONE, IT ISN'T A WORKER
+    RunTasks(Tasks, false);
+}
+
+//------------------------------------------------------------------------------
+/**
+*/
+void
+Raytracer::OpenPerfCounters() {
+    std::vector<std::unique_ptr<PerfCounters>> Counters(ThreadCounts);
+    std::vector<std::string> Errors(ThreadCounts);
+    RunOnEveryWorker([&Counters, &Errors](int Index) {
+        Counters[Index].reset(new PerfCounters());
+        if (!Counters[Index]->Open(Errors[Index]))
+            Counters[Index].reset();
+    });
+
+    for (size_t i = 0; i < Counters.size(); i++) {
+        if (!Counters[i]) {
+            PerfError = Errors[i];
+            std::cout << "Perf Counters: " << PerfError << std::endl;
+            return;
         }
-        RayTraceChunk(Chunk);
+    }
+    WorkerPerf = std::move(Counters);
+}
+
+//------------------------------------------------------------------------------
+/**
+*/
+void
+Raytracer::PrintPerfCounters() const {
+    if (!bPerfCounters || FramePerf.empty())
+        return;
+
+    PerfCounterValues Total;
+    for (const PerfCounterValues& Worker : FramePerf)
+        Total += Worker;
+    const PerfCounters& Counters = *WorkerPerf[0];
+    double Rays = (double)std::max<uint64_t>(FramePerfRays, 1);
+    std::cout << "Perf Counters (user space, all workers):" << std::endl;
+    std::cout << "  Cycles: " << Total.Cycles << std::endl;
+    std::cout << "  Instructions: " << Total.Instructions << std::endl;
+    std::cout << "  IPC: " << (Total.Cycles ? (double)Total.Instructions / Total.Cycles : 0.0) << std::endl;
+    std::cout << "  Cycles Per Camera Ray: " << Total.Cycles / Rays << std::endl;
+    if (Counters.Has(PerfCounters::L1DMisses))
+        std::cout << "  L1D Read Misses Per Camera Ray: " << Total.L1DMisses / Rays << std::endl;
+    if (Counters.Has(PerfCounters::LLCMisses))
+        std::cout << "  LLC Misses Per Camera Ray: " << Total.LLCMisses / Rays << std::endl;
+    if (Counters.Has(PerfCounters::BranchMisses))
+        std::cout << "  Branch Misses Per Camera Ray: " << Total.BranchMisses / Rays << std::endl;
+    for (size_t i = 0; i < FramePerf.size(); i++) {
+        const PerfCounterValues& Worker = FramePerf[i];
+        std::cout << "  Worker " << i << ": " << Worker.Cycles << " cycles, IPC "
+                  << (Worker.Cycles ? (double)Worker.Instructions / Worker.Cycles : 0.0) << std::endl;
     }
 }
 
@@ -338,7 +838,9 @@ Raytracer::Clear()
         color.g = 0.0f;
         color.b = 0.0f;
     }
-    this->RayNum = 0;
+    for (unsigned i = 0; i < ThreadCounts; i++)
+        WorkerRays[i].Counters = RayCounters();
+    CallerRays.Reset();
 }
 
 //------------------------------------------------------------------------------
@@ -2,7 +2,13 @@
 #include <vector>
 #include <float.h>
 #include <queue>
+#include <deque>
 #include <condition_variable>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <functional>
+#include <future>
 
 #include "vec3.h"
 #include "mat4.h"
@@ -10,6 +16,15 @@
 #include "ray.h"
 #include "object.h"
 #include "bvh.h"
+#include "widebvh.h"
+#include "lbvh.h"
+#include "bvhcache.h"
+#include "stats.h"
+#include "profiler.h"
+#include "perfcounters.h"
+#include "tiles.h"
+#include "workqueue.h"
+#include <memory>
 
 //------------------------------------------------------------------------------
 /**
@@ -17,40 +32,152 @@
 class Raytracer
 {
 public:
-    Raytracer(unsigned w, unsigned h, std::vector<Color>& frameBuffer, unsigned rpp, unsigned bounces);
+    // threads = 0 spawns one worker per hardware thread
+    Raytracer(unsigned w, unsigned h, std::vector<Color>& frameBuffer, unsigned rpp, unsigned bounces, unsigned threads = 0);
     ~Raytracer();
 
     // MULTI THREADING
 	std::vector<std::thread> Threads;
 	std::atomic<int> AvailableThreads;
-	std::atomic<int> JobsCompleted = 0;
     std::atomic<int> PixelCounter;
+    // ONE DEQUE PER WORKER, THE LAST ONE BELONGS TO WHICHEVER OUTSIDE THREAD HOLDS CallerMutex
+    std::vector<std::unique_ptr<WorkStealingDeque<PoolTask*>>> Deques;
+    std::mutex CallerMutex;
+    // bumped whenever tasks get pushed, idle workers sleep on Mutex until it changes
+    std::atomic<uint64_t> WakeEpoch{ 0 };
 	std::condition_variable Mutex;
-    std::queue<vec2> ChunkInfo;
 	std::mutex QueueMutex;
-    void ThreadLoop();
+    void ThreadLoop(int Index);
+    // pop from the deque in Slot, or steal from the others
+    bool FindTask(unsigned Slot, PoolTask*& Task);
+    void WakeWorkers();
+    // index of the worker running on this thread, -1 on threads the raytracer didn't spawn
+    static thread_local int WorkerIndex;
     unsigned int Depth = 1;
 
-    Node* MainNode;
+    Node* MainNode = nullptr;
+    FlatBVH Flat;
+    // 2 traverses Flat, 4 and 8 the collapsed wide BVHs below
+    int BVHWidth = 2;
+    WideBVH<4> Wide4;
+    WideBVH<8> Wide8;
+    BVHBuildSettings BuildSettings;
     int MaxPixel;
-    int RayNum = 0;
 	bool bShouldTerminate = false;
     unsigned int ThreadCounts = 0;
 
     // SETUP
     void SetUpNode(BoundingBox Box, std::vector<Sphere*> Spheres);
-    void SpawnThread();
+    // call after moving spheres: refits the BVH, or rebuilds it once refitting
+    // pushed its SAH cost past RebuildThreshold times the cost after building.
+    // returns true if it rebuilt
+    bool UpdateBVH();
+    float RebuildThreshold = 1.5f;
+    float BuiltSAHCost = 0.0f;
+    std::vector<Sphere*> BVHSpheres;
+    // when set, SetUpNode loads the BVH from this directory if it was built
+    // for the same scene before, and stores it there otherwise
+    std::string BVHCacheDir;
+    bool bBVHFromCache = false;
+    void SpawnThread(unsigned Count);
+
+    // TILES, A FRAME IS ONE TASK PER TILE
+    // edge of the square tiles in pixels, 0 picks one from the image size and thread count
+    unsigned TileSize = 0;
+    TileOrder TileOrdering = TileOrder::Hilbert;
+    std::vector<Tile> Tiles;
+    unsigned TilesBuiltSize = 0;
+    TileOrder TilesBuiltOrder = TileOrder::Hilbert;
+
+    // counts the frames AssignJob rendered, it is part of every path's random seed
+    // so accumulated frames don't repeat each other
+    unsigned FrameIndex = 0;
+    // picks a different, but just as reproducible, set of samples
+    uint32_t Seed = 0;
 
     // MULTI THREADING METHOD
-    unsigned AssignJob();
-    void QueueChunk(vec2 &Chunk);
-    void RayTraceChunk(vec2 &chunk);
+    // renders a frame into Target, or into frameBuffer if it is null. Frames asked
+    // for from several threads at once run one after another
+    unsigned AssignJob(Color* Target = nullptr);
+    // queues AssignJob for the pool, an idle worker picks it up and renders tiles
+    // like any caller. Target has to outlive the future
+    std::future<unsigned> AssignJobAsync(Color* Target = nullptr);
+    // queues Job to run on an idle worker while it holds FrameMutex, so queued jobs
+    // run one at a time and in order. Job may call AssignJob
+    template<typename F>
+    std::future<decltype(std::declval<F&>()())> QueueFrameJob(F Job);
+    // ONE FRAME AT A TIME, AssignJob HOLDS IT FOR THE WHOLE FRAME SINCE EVERY FRAME
+    // WRITES Tiles, FrameIndex AND FrameRays. RECURSIVE FOR QUEUED JOBS CALLING AssignJob
+    std::recursive_mutex FrameMutex;
+    // guarded by QueueMutex, the count lets idle workers look without the lock
+    std::deque<std::function<void()>> FrameJobs;
+    std::atomic<size_t> FrameJobCount{ 0 };
+    // run the oldest queued frame job if no frame is rendering, never waits for FrameMutex
+    bool RunFrameJob();
+    // unlock FrameMutex and wake a worker for the next queued frame job
+    void ReleaseFrame();
+    // holds FrameMutex for its scope and hands it back through ReleaseFrame, also
+    // when the frame throws, so a failed frame can't stall every later one
+    class FrameLock
+    {
+    public:
+        explicit FrameLock(Raytracer& tracer) : Tracer(tracer) { Tracer.FrameMutex.lock(); }
+        // for a mutex the caller already locked
+        FrameLock(Raytracer& tracer, std::adopt_lock_t) : Tracer(tracer) {}
+        ~FrameLock() { Tracer.ReleaseFrame(); }
+        FrameLock(const FrameLock&) = delete;
+        FrameLock& operator=(const FrameLock&) = delete;
+    private:
+        Raytracer& Tracer;
+    };
+    // run the tasks on the worker threads, returns once all of them are done.
+    // the calling thread runs tasks too unless bHelp is false
+    void RunTasks(std::vector<std::function<void()>>& Tasks, bool bHelp = true);
+    // trace the pixels in [MinX, MaxX) x [MinY, MaxY) on the calling thread,
+    // Target is a width * height image
+    void RayTraceTile(unsigned MinX, unsigned MinY, unsigned MaxX, unsigned MaxY, Color* Target);
     void Stop();
 
+    // RAY COUNTERS, ALWAYS COUNTED
+    // one slot per worker
+    std::unique_ptr<PaddedRayCounters[]> WorkerRays;
+    // shared by threads calling RayTraceTile themselves
+    SharedRayCounters CallerRays;
+    // rays of the last AssignJob
+    RayCounters FrameRays;
+    // totals of every slot since the raytracer was created or cleared
+    RayCounters RayStats() const;
+    void PrintRayStats(float frameDuration) const;
+
+    // TRAVERSAL STATISTICS, ONLY COUNTED WITH TRAYRACER_STATS
+    // one slot per worker, the last one is shared by threads calling RayTraceTile themselves
+    std::vector<TraversalCounters> ThreadStats;
+    // counters of every pixel in the last frame
+    std::vector<PixelCounters> PixelStats;
+    std::mutex StatsMutex;
+    TraversalCounters TraversalStats() const;
+    // AssignJob calls this at the start of every frame
+    void ResetTraversalStats();
+    void PrintTraversalStats() const;
+
+    // HARDWARE COUNTERS, SET bPerfCounters BEFORE THE FIRST FRAME
+    bool bPerfCounters = false;
+    // one per worker, opened on the worker itself
+    std::vector<std::unique_ptr<PerfCounters>> WorkerPerf;
+    // counter deltas of every worker over the last frame
+    std::vector<PerfCounterValues> FramePerf;
+    uint64_t FramePerfRays = 0;
+    std::string PerfError;
+    void OpenPerfCounters();
+    void PrintPerfCounters() const;
+    // run Func once on every worker thread, with the worker's index
+    void RunOnEveryWorker(const std::function<void(int)>& Func);
+
     // RAYTRACING
-    Color GetColor(float u, float v, int x, int y);
+    Color GetColor(float u, float v);
     Color GetColor2(int x, int y);
-    void AssignColor(Color &color, int x, int y);
+    // divide the sample sum in color by rpp and add it to the pixel in Target
+    void AssignColor(Color &color, Color* Target, int x, int y);
 
     unsigned int Raytrace();
 
@@ -59,7 +186,10 @@ public:
     // add object to scene
     void AddObject(Sphere* obj);
 
-    void HitTest(Node*& node, HitResult& closestHit, Ray ray);
+    void HitTest(unsigned First, unsigned Count, HitResult& closestHit, Ray& ray);
+    void TraverseBinary(Ray& ray, HitResult& closestHit);
+    template<int N>
+    void TraverseWide(const WideBVH<N>& bvh, Ray& ray, HitResult& closestHit);
 
     // single raycast, find object
     //static bool Raycast(Ray ray, vec3& hitPoint, vec3& hitNormal, Object*& hitObject, float& distance, std::vector<Object*> objects);
@@ -122,3 +252,20 @@ inline void Raytracer::SetViewMatrix(mat4 val)
     this->view = val;
     this->UpdateMatrices();
 }
+
+template<typename F>
+std::future<decltype(std::declval<F&>()())>
+Raytracer::QueueFrameJob(F Job)
+{
+    typedef decltype(Job()) Result;
+    // std::function WANTS SOMETHING COPYABLE, THE TASK ITSELF ISN'T
+    std::shared_ptr<std::packaged_task<Result()>> Task(new std::packaged_task<Result()>(std::move(Job)));
+    std::future<Result> Future = Task->get_future();
+    {
+        std::unique_lock<std::mutex> lock(QueueMutex);
+        FrameJobs.push_back([Task]() { (*Task)(); });
+        FrameJobCount.store(FrameJobs.size());
+    }
+    WakeWorkers();
+    return Future;
+}
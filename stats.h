@@ -0,0 +1,133 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <vector>
+
+//------------------------------------------------------------------------------
+/**
+    Traversal statistics. Configure with -DTRAYRACER_STATS=ON to count nodes
+    visited, box tests, sphere tests and bounces, per thread and per pixel.
+    With it off every TRAYRACER_STAT() expands to nothing.
+*/
+#ifndef TRAYRACER_STATS
+#define TRAYRACER_STATS 0
+#endif
+
+#if TRAYRACER_STATS
+#define TRAYRACER_STAT(expr) expr
+#else
+#define TRAYRACER_STAT(expr)
+#endif
+
+struct TraversalCounters
+{
+	// nodes whose children or primitives were looked at
+	uint64_t NodesVisited = 0;
+	// ray/box slab tests, one per child lane in the wide BVHs
+	uint64_t BoxTests = 0;
+	uint64_t SphereTests = 0;
+	// scattered rays traced after the camera ray
+	uint64_t Bounces = 0;
+	// camera rays, each one starts a path
+	uint64_t Paths = 0;
+
+	void operator+=(const TraversalCounters& rhs) {
+		NodesVisited += rhs.NodesVisited;
+		BoxTests += rhs.BoxTests;
+		SphereTests += rhs.SphereTests;
+		Bounces += rhs.Bounces;
+		Paths += rhs.Paths;
+	}
+
+	TraversalCounters operator-(const TraversalCounters& rhs) const {
+		TraversalCounters result;
+		result.NodesVisited = NodesVisited - rhs.NodesVisited;
+		result.BoxTests = BoxTests - rhs.BoxTests;
+		result.SphereTests = SphereTests - rhs.SphereTests;
+		result.Bounces = Bounces - rhs.Bounces;
+		result.Paths = Paths - rhs.Paths;
+		return result;
+	}
+};
+
+// per pixel totals of one frame, summed over its samples
+struct PixelCounters
+{
+	uint32_t NodesVisited = 0;
+	uint32_t BoxTests = 0;
+	uint32_t SphereTests = 0;
+	uint32_t Bounces = 0;
+};
+
+// RUNNING TOTALS OF THE CALLING THREAD, THE TRAVERSAL ONLY EVER TOUCHES ITS OWN
+inline thread_local TraversalCounters ThreadCounters;
+
+//------------------------------------------------------------------------------
+/**
+    Ray counters. Unlike the traversal statistics these are always on, every
+    thread counts into thread local totals and a tile adds what it traced to
+    the padded slot of its worker once it is done.
+*/
+struct RayCounters
+{
+	// one per path
+	uint64_t CameraRays = 0;
+	// scattered rays traced after a hit
+	uint64_t Bounces = 0;
+	// paths cut off at the bounce limit, the others escaped to the sky
+	uint64_t TerminatedPaths = 0;
+
+	uint64_t Rays() const { return CameraRays + Bounces; }
+
+	void operator+=(const RayCounters& rhs) {
+		CameraRays += rhs.CameraRays;
+		Bounces += rhs.Bounces;
+		TerminatedPaths += rhs.TerminatedPaths;
+	}
+
+	RayCounters operator-(const RayCounters& rhs) const {
+		RayCounters result;
+		result.CameraRays = CameraRays - rhs.CameraRays;
+		result.Bounces = Bounces - rhs.Bounces;
+		result.TerminatedPaths = TerminatedPaths - rhs.TerminatedPaths;
+		return result;
+	}
+};
+
+// ONE CACHE LINE PER WORKER, SO MERGING A TILE NEVER TOUCHES ANOTHER WORKER'S LINE.
+// ONLY THE WORKER WRITES ITS SLOT AND THE FRAME READS IT AFTER ITS LATCH, SO PLAIN ADDS DO
+struct alignas(64) PaddedRayCounters
+{
+	RayCounters Counters;
+};
+
+// THE SLOT OUTSIDE THREADS SHARE, SEVERAL OF THEM MAY RENDER TILES AT ONCE
+struct alignas(64) SharedRayCounters
+{
+	std::atomic<uint64_t> CameraRays{ 0 };
+	std::atomic<uint64_t> Bounces{ 0 };
+	std::atomic<uint64_t> TerminatedPaths{ 0 };
+
+	void Add(const RayCounters& counters) {
+		CameraRays.fetch_add(counters.CameraRays, std::memory_order_relaxed);
+		Bounces.fetch_add(counters.Bounces, std::memory_order_relaxed);
+		TerminatedPaths.fetch_add(counters.TerminatedPaths, std::memory_order_relaxed);
+	}
+
+	RayCounters Load() const {
+		RayCounters counters;
+		counters.CameraRays = CameraRays.load(std::memory_order_relaxed);
+		counters.Bounces = Bounces.load(std::memory_order_relaxed);
+		counters.TerminatedPaths = TerminatedPaths.load(std::memory_order_relaxed);
+		return counters;
+	}
+
+	void Reset() {
+		CameraRays.store(0, std::memory_order_relaxed);
+		Bounces.store(0, std::memory_order_relaxed);
+		TerminatedPaths.store(0, std::memory_order_relaxed);
+	}
+};
+
+// RUNNING RAY TOTALS OF THE CALLING THREAD
+inline thread_local RayCounters ThreadRays;
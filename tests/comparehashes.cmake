@@ -0,0 +1,51 @@
+#--------------------------------------------------------------------------
+# Runs trayracer_headless once for every argument set in RUNS and fails
+# unless all of them print the same Image Hash.
+#
+#   -DEXE=path        the headless renderer
+#   -DRUNS=a|b|...    argument sets, split on |, each one split like a shell line
+#   -DEXPECT=a|b|...  optional, a regex the output of the run at the same index has to match
+#   -DCLEAN=dir       optional, removed before the first run
+#--------------------------------------------------------------------------
+IF(CLEAN)
+	FILE(REMOVE_RECURSE "${CLEAN}")
+	FILE(MAKE_DIRECTORY "${CLEAN}")
+ENDIF()
+
+STRING(REPLACE "|" ";" RUN_LIST "${RUNS}")
+STRING(REPLACE "|" ";" EXPECT_LIST "${EXPECT}")
+LIST(LENGTH EXPECT_LIST EXPECT_COUNT)
+
+SET(INDEX 0)
+SET(FIRST_HASH "")
+FOREACH(RUN ${RUN_LIST})
+	SEPARATE_ARGUMENTS(RUN_ARGS UNIX_COMMAND "${RUN}")
+	EXECUTE_PROCESS(COMMAND "${EXE}" ${RUN_ARGS}
+		RESULT_VARIABLE RESULT
+		OUTPUT_VARIABLE OUTPUT
+		ERROR_VARIABLE OUTPUT)
+	IF(NOT RESULT EQUAL 0)
+		MESSAGE(FATAL_ERROR "'${RUN}' exited with ${RESULT}:\n${OUTPUT}")
+	ENDIF()
+
+	STRING(REGEX MATCH "Image Hash: ([0-9a-f]+)" HASH_LINE "${OUTPUT}")
+	IF(NOT HASH_LINE)
+		MESSAGE(FATAL_ERROR "'${RUN}' printed no image hash:\n${OUTPUT}")
+	ENDIF()
+	SET(HASH "${CMAKE_MATCH_1}")
+	MESSAGE(STATUS "${HASH}  ${RUN}")
+
+	IF(INDEX LESS EXPECT_COUNT)
+		LIST(GET EXPECT_LIST ${INDEX} PATTERN)
+		IF(PATTERN AND NOT OUTPUT MATCHES "${PATTERN}")
+			MESSAGE(FATAL_ERROR "'${RUN}' did not print '${PATTERN}':\n${OUTPUT}")
+		ENDIF()
+	ENDIF()
+
+	IF(INDEX EQUAL 0)
+		SET(FIRST_HASH "${HASH}")
+	ELSEIF(NOT HASH STREQUAL FIRST_HASH)
+		MESSAGE(FATAL_ERROR "'${RUN}' rendered ${HASH}, the first run rendered ${FIRST_HASH}")
+	ENDIF()
+	MATH(EXPR INDEX "${INDEX} + 1")
+ENDFOREACH()
@@ -0,0 +1,117 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+// Rectangle of pixels [MinX, MaxX) x [MinY, MaxY) rendered as one task
+struct Tile
+{
+	unsigned MinX, MinY;
+	unsigned MaxX, MaxY;
+};
+
+// order the tiles are handed to the workers in
+enum class TileOrder
+{
+	Scanline,
+	Morton,
+	Hilbert
+};
+
+
+//------------------------------------------------------------------------------
+/**
+	Interleaves the bits of x and y, x in the even bits
+*/
+inline uint64_t
+MortonKey2D(uint32_t x, uint32_t y)
+{
+	uint64_t key = 0;
+	for (int bit = 0; bit < 32; bit++) {
+		key |= (uint64_t)((x >> bit) & 1) << (2 * bit);
+		key |= (uint64_t)((y >> bit) & 1) << (2 * bit + 1);
+	}
+	return key;
+}
+
+//------------------------------------------------------------------------------
+/**
+	Distance of (x, y) along the Hilbert curve filling an n x n grid, n a power of two
+*/
+inline uint64_t
+HilbertKey2D(uint32_t n, uint32_t x, uint32_t y)
+{
+	uint64_t d = 0;
+	for (uint32_t s = n / 2; s > 0; s /= 2) {
+		uint32_t rx = (x & s) > 0;
+		uint32_t ry = (y & s) > 0;
+		d += (uint64_t)s * s * ((3 * rx) ^ ry);
+		// ROTATE THE QUADRANT SO THE SUB CURVE CONNECTS
+		if (ry == 0) {
+			if (rx == 1) {
+				x = s - 1 - x;
+				y = s - 1 - y;
+			}
+			std::swap(x, y);
+		}
+	}
+	return d;
+}
+
+//------------------------------------------------------------------------------
+/**
+	Picks the tile edge when none is given: the largest of 64, 32, 16 and 8
+	that still gives every thread TilesPerThread tiles, so the last tiles of
+	a frame are small enough to even out uneven ones
+*/
+inline unsigned
+ChooseTileSize(unsigned width, unsigned height, unsigned threads)
+{
+	const unsigned TilesPerThread = 8;
+	const unsigned Wanted = std::max(threads, 1u) * TilesPerThread;
+	for (unsigned size : { 64u, 32u, 16u }) {
+		unsigned count = ((width + size - 1) / size) * ((height + size - 1) / size);
+		if (count >= Wanted)
+			return size;
+	}
+	return 8;
+}
+
+//------------------------------------------------------------------------------
+/**
+	Cuts the image into size x size tiles, the ones on the right and top
+	edge are cut short, and sorts them along the requested curve
+*/
+inline std::vector<Tile>
+MakeTiles(unsigned width, unsigned height, unsigned size, TileOrder order)
+{
+	size = std::max(size, 1u);
+	const unsigned TilesX = (width + size - 1) / size;
+	const unsigned TilesY = (height + size - 1) / size;
+	uint32_t GridSize = 1;
+	while (GridSize < std::max(TilesX, TilesY))
+		GridSize *= 2;
+
+	std::vector<std::pair<uint64_t, Tile>> Keyed;
+	Keyed.reserve(TilesX * TilesY);
+	for (unsigned ty = 0; ty < TilesY; ty++) {
+		for (unsigned tx = 0; tx < TilesX; tx++) {
+			Tile tile = { tx * size, ty * size, std::min((tx + 1) * size, width), std::min((ty + 1) * size, height) };
+			uint64_t key = (uint64_t)ty * TilesX + tx;
+			if (order == TileOrder::Morton)
+				key = MortonKey2D(tx, ty);
+			else if (order == TileOrder::Hilbert)
+				key = HilbertKey2D(GridSize, tx, ty);
+			Keyed.push_back({ key, tile });
+		}
+	}
+	std::sort(Keyed.begin(), Keyed.end(), [](const std::pair<uint64_t, Tile>& a, const std::pair<uint64_t, Tile>& b) {
+		return a.first < b.first;
+	});
+
+	std::vector<Tile> Tiles;
+	Tiles.reserve(Keyed.size());
+	for (const auto& keyed : Keyed)
+		Tiles.push_back(keyed.second);
+	return Tiles;
+}
@@ -0,0 +1,251 @@
+#include "trayracer.h"
+#include "raytracer.h"
+#include "sphere.h"
+#include "material.h"
+#include "app.h"
+#include "random.h"
+#include <chrono>
+#include <cstring>
+
+// CALLER IMAGES ARE HANDED TO THE RAYTRACER AS Color ARRAYS WITHOUT A COPY
+static_assert(sizeof(Color) == 3 * sizeof(float), "Color must be laid out as three floats");
+
+namespace Trayracer
+{
+
+struct Scene::Data
+{
+	std::vector<Sphere*> Spheres;
+};
+
+struct Renderer::Data
+{
+	Data(const RenderSettings& settings) :
+		Tracer(settings.Width, settings.Height, Framebuffer, settings.RaysPerPixel, settings.MaxBounces, settings.Threads),
+		Settings(settings)
+	{
+		Tracer.TileSize = settings.TileSize;
+		Tracer.Seed = settings.Seed;
+	}
+
+	// the Raytracer wants a framebuffer of its own, every render goes to the caller's image instead
+	std::vector<Color> Framebuffer;
+	::Raytracer Tracer;
+	RenderSettings Settings;
+	RenderStats Stats;
+};
+
+//------------------------------------------------------------------------------
+/**
+*/
+Scene::Scene() :
+	data(new Data)
+{
+}
+
+//------------------------------------------------------------------------------
+/**
+*/
+Scene::~Scene()
+{
+	for (Sphere* sphere : data->Spheres) {
+		delete sphere->material;
+		delete sphere;
+	}
+	delete data;
+}
+
+//------------------------------------------------------------------------------
+/**
+*/
+size_t
+Scene::AddSphere(const SphereDesc& desc)
+{
+	static const char* const TypeNames[] = { "Lambertian", "Conductor", "Dielectric" };
+
+	Material* mat = new Material();
+	mat->type = TypeNames[(int)desc.Material];
+	mat->color = { desc.Color[0], desc.Color[1], desc.Color[2] };
+	mat->roughness = desc.Roughness;
+	mat->refractionIndex = desc.RefractionIndex;
+	data->Spheres.push_back(new Sphere(desc.Radius, { desc.Center[0], desc.Center[1], desc.Center[2] }, mat));
+	return data->Spheres.size() - 1;
+}
+
+//------------------------------------------------------------------------------
+/**
+*/
+void
+Scene::AddRandomSpheres(int count, uint32_t seed)
+{
+	if (seed)
+		SeedRandom(seed);
+	std::vector<Sphere*> Spheres = CreateSpheres(count);
+	data->Spheres.insert(data->Spheres.end(), Spheres.begin(), Spheres.end());
+}
+
+//------------------------------------------------------------------------------
+/**
+*/
+size_t
+Scene::Size() const
+{
+	return data->Spheres.size();
+}
+
+//------------------------------------------------------------------------------
+/**
+*/
+Renderer::Renderer(const RenderSettings& settings) :
+	data(new Data(settings))
+{
+	this->SetCamera(Camera());
+}
+
+//------------------------------------------------------------------------------
+/**
+*/
+Renderer::~Renderer()
+{
+	delete data;
+}
+
+//------------------------------------------------------------------------------
+/**
+*/
+void
+Renderer::BuildAccelerationStructure(const Scene& scene)
+{
+	::Raytracer& rt = data->Tracer;
+	const RenderSettings& settings = data->Settings;
+
+	rt.BuildSettings = BVHBuildSettings();
+	rt.BuildSettings.Builder = settings.Builder == AccelBuilder::LBVH ? BVHBuilder::LBVH : BVHBuilder::SAH;
+	rt.BuildSettings.SplitMode = settings.Builder == AccelBuilder::SAHSpatial ? BVHSplitMode::Spatial : BVHSplitMode::Object;
+	rt.BuildSettings.BinCount = settings.BinCount;
+	rt.BuildSettings.MaxLeafSize = settings.MaxLeafSize;
+	rt.BVHCacheDir = settings.CacheDir;
+	rt.BVHWidth = settings.BVHWidth;
+	rt.objects = scene.data->Spheres;
+
+	auto start = std::chrono::high_resolution_clock::now();
+	rt.SetUpNode(BoundingBox(), scene.data->Spheres);
+	auto end = std::chrono::high_resolution_clock::now();
+
+	data->Stats.BuildSeconds = std::chrono::duration<double>(end - start).count();
+	data->Stats.BVHNodes = rt.Flat.Nodes.size();
+	data->Stats.BVHReferences = rt.Flat.PrimIndices.size();
+	data->Stats.bBVHFromCache = rt.bBVHFromCache;
+}
+
+//------------------------------------------------------------------------------
+/**
+*/
+void
+Renderer::SetCamera(const Camera& camera)
+{
+	mat4 cameraTransform = multiply(rotationy(camera.Yaw), rotationx(camera.Pitch));
+	cameraTransform.m30 = camera.Position[0];
+	cameraTransform.m31 = camera.Position[1];
+	cameraTransform.m32 = camera.Position[2];
+	data->Tracer.SetViewMatrix(cameraTransform);
+}
+
+//------------------------------------------------------------------------------
+/**
+*/
+void
+Renderer::RenderFrame(float* rgb)
+{
+	// HELD FROM CLEARING rgb TO THE STATS, AssignJob TAKES IT AGAIN
+	Raytracer::FrameLock lock(data->Tracer);
+	memset(rgb, 0, sizeof(float) * 3 * data->Settings.Width * data->Settings.Height);
+
+	auto start = std::chrono::high_resolution_clock::now();
+	data->Tracer.AssignJob((Color*)rgb);
+	auto end = std::chrono::high_resolution_clock::now();
+
+	data->Stats.LastFrameSeconds = std::chrono::duration<double>(end - start).count();
+	data->Stats.TotalFrameSeconds += data->Stats.LastFrameSeconds;
+	data->Stats.Frames++;
+}
+
+//------------------------------------------------------------------------------
+/**
+*/
+std::future<void>
+Renderer::RenderFrameAsync(float* rgb)
+{
+	return data->Tracer.QueueFrameJob([this, rgb]() { RenderFrame(rgb); });
+}
+
+//------------------------------------------------------------------------------
+/**
+*/
+void
+Renderer::RenderTile(unsigned minX, unsigned minY, unsigned maxX, unsigned maxY, float* rgb)
+{
+	const unsigned width = data->Settings.Width;
+	maxX = std::min(maxX, width);
+	maxY = std::min(maxY, data->Settings.Height);
+	if (minX >= maxX || minY >= maxY)
+		return;
+
+	for (unsigned y = minY; y < maxY; y++)
+		memset(rgb + 3 * ((size_t)y * width + minX), 0, sizeof(float) * 3 * (maxX - minX));
+	data->Tracer.RayTraceTile(minX, minY, maxX, maxY, (Color*)rgb);
+}
+
+//------------------------------------------------------------------------------
+/**
+*/
+RenderStats
+Renderer::GetStats() const
+{
+	// A FRAME ON THE POOL WRITES ALL OF THESE
+	Raytracer::FrameLock lock(data->Tracer);
+	RenderStats stats = data->Stats;
+	const RayCounters Rays = data->Tracer.RayStats();
+	stats.CameraRays = Rays.CameraRays;
+	stats.Bounces = Rays.Bounces;
+	stats.TerminatedPaths = Rays.TerminatedPaths;
+	if (stats.LastFrameSeconds > 0)
+		stats.LastFrameMRaysPerSecond = data->Tracer.FrameRays.Rays() / stats.LastFrameSeconds * 1e-6;
+	return stats;
+}
+
+//------------------------------------------------------------------------------
+/**
+*/
+unsigned
+Renderer::Width() const
+{
+	return data->Settings.Width;
+}
+
+//------------------------------------------------------------------------------
+/**
+*/
+unsigned
+Renderer::Height() const
+{
+	return data->Settings.Height;
+}
+
+//------------------------------------------------------------------------------
+/**
+*/
+uint64_t
+HashImage(const float* rgb, unsigned width, unsigned height)
+{
+	const unsigned char* bytes = (const unsigned char*)rgb;
+	const size_t size = sizeof(float) * 3 * (size_t)width * height;
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	for (size_t i = 0; i < size; i++) {
+		hash ^= bytes[i];
+		hash *= 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+} // namespace Trayracer
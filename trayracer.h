@@ -0,0 +1,177 @@
+#pragma once
+//------------------------------------------------------------------------------
+/**
+	Public interface of trayracer_core, for embedding the renderer without
+	the viewer. Only this header is needed, none of the renderer internals
+	leak through it.
+
+	Images are width * height * 3 floats of linear rgb owned by the caller,
+	row 0 is the bottom row.
+*/
+//------------------------------------------------------------------------------
+#include <cstddef>
+#include <cstdint>
+#include <future>
+#include <string>
+
+namespace Trayracer
+{
+
+enum class MaterialType
+{
+	Lambertian,
+	Conductor,
+	Dielectric
+};
+
+struct SphereDesc
+{
+	float Center[3] = { 0, 0, 0 };
+	float Radius = 1.0f;
+	MaterialType Material = MaterialType::Lambertian;
+	float Color[3] = { 0.5f, 0.5f, 0.5f };
+	float Roughness = 0.75f;
+	// only used by dielectrics
+	float RefractionIndex = 1.44f;
+};
+
+enum class AccelBuilder
+{
+	// binned SAH, the best trees
+	SAH,
+	// binned SAH with spatial splits, for scenes with large overlapping spheres
+	SAHSpatial,
+	// Morton code builder, the fastest to build
+	LBVH
+};
+
+struct RenderSettings
+{
+	unsigned Width = 1500;
+	unsigned Height = 1500;
+	unsigned RaysPerPixel = 1;
+	unsigned MaxBounces = 5;
+	// worker threads, 0 uses one per hardware thread
+	unsigned Threads = 0;
+	// edge of the square tiles a frame is split into, 0 picks one from the image size and thread count
+	unsigned TileSize = 0;
+	// the samples of a pixel only depend on the scene, this seed, the pixel and the frame
+	// number, never on the thread count or tile size
+	uint32_t Seed = 0;
+
+	AccelBuilder Builder = AccelBuilder::SAH;
+	// 2, 4 or 8 children per node during traversal
+	int BVHWidth = 2;
+	int BinCount = 16;
+	int MaxLeafSize = 8;
+	// directory of the on-disk BVH cache, empty disables it
+	std::string CacheDir;
+};
+
+struct Camera
+{
+	float Position[3] = { 0, 1.0f, 10.0f };
+	// radians, same convention as the viewer's mouse look
+	float Pitch = 0;
+	float Yaw = 0;
+};
+
+struct RenderStats
+{
+	// camera rays traced since the renderer was created, one per path
+	uint64_t CameraRays = 0;
+	// scattered rays traced after a hit, and paths cut off at MaxBounces
+	uint64_t Bounces = 0;
+	uint64_t TerminatedPaths = 0;
+	// camera rays and bounces of the last RenderFrame, divided by its time
+	double LastFrameMRaysPerSecond = 0;
+	// RenderFrame calls, tiles are not counted
+	unsigned Frames = 0;
+	double BuildSeconds = 0;
+	double LastFrameSeconds = 0;
+	double TotalFrameSeconds = 0;
+	size_t BVHNodes = 0;
+	// primitive references in the BVH leaves, above the sphere count with spatial splits
+	size_t BVHReferences = 0;
+	bool bBVHFromCache = false;
+};
+
+//------------------------------------------------------------------------------
+/**
+	Owns the spheres and their materials until it is destroyed, so it has to
+	outlive every Renderer it was built into.
+*/
+class Scene
+{
+public:
+	/// constructor
+	Scene();
+	/// destructor
+	~Scene();
+
+	Scene(const Scene&) = delete;
+	Scene& operator=(const Scene&) = delete;
+
+	/// add a sphere, returns its index
+	size_t AddSphere(const SphereDesc& desc);
+	/// add the ground and count random spheres, the same scene the viewer shows.
+	/// A nonzero seed restarts the random sequence first, so the scene is the same every run
+	void AddRandomSpheres(int count, uint32_t seed = 0);
+	/// number of spheres
+	size_t Size() const;
+
+private:
+	friend class Renderer;
+	struct Data;
+	Data* data;
+};
+
+//------------------------------------------------------------------------------
+/**
+	Renders a Scene on its own worker threads. The thread pool is created in
+	the constructor and stopped in the destructor.
+*/
+class Renderer
+{
+public:
+	/// constructor
+	Renderer(const RenderSettings& settings);
+	/// destructor
+	~Renderer();
+
+	Renderer(const Renderer&) = delete;
+	Renderer& operator=(const Renderer&) = delete;
+
+	/// build, or load from the cache, the acceleration structure over the scene
+	void BuildAccelerationStructure(const Scene& scene);
+	/// place the camera used by the following renders
+	void SetCamera(const Camera& camera);
+
+	/// render one frame on the worker threads and overwrite rgb with it
+	void RenderFrame(float* rgb);
+	/// queue RenderFrame on the worker threads and return at once. Frames queued
+	/// together render one after another. rgb has to stay alive and the renderer
+	/// untouched until the future is ready
+	std::future<void> RenderFrameAsync(float* rgb);
+	/// render the pixels in [minX, maxX) x [minY, maxY) on the calling thread and
+	/// overwrite them in rgb, which is still a full image. Tiles that do not overlap
+	/// can be rendered from several threads at once
+	void RenderTile(unsigned minX, unsigned minY, unsigned maxX, unsigned maxY, float* rgb);
+
+	/// statistics of the renders so far. Waits for a frame that is rendering,
+	/// RenderFrameAsync included, to finish first
+	RenderStats GetStats() const;
+
+	/// size of the images this renderer expects
+	unsigned Width() const;
+	unsigned Height() const;
+
+private:
+	struct Data;
+	Data* data;
+};
+
+/// 64 bit FNV-1a hash of the width * height rgb floats, equal hashes mean bit identical images
+uint64_t HashImage(const float* rgb, unsigned width, unsigned height);
+
+} // namespace Trayracer
@@ -1,112 +1,151 @@
 #pragma once
 #include <cmath>
-#include <initializer_list>
 #include <assert.h>
 
+//------------------------------------------------------------------------------
+/**
+    vec3 is single precision. Configure with -DTRAYRACER_DOUBLE_VEC3=ON where
+    precision matters more than speed, or with -DTRAYRACER_SIMD_VEC3=ON for a
+    16 byte aligned float vec3 whose componentwise math runs on SSE or NEON.
+*/
+#ifndef TRAYRACER_DOUBLE_VEC3
+#define TRAYRACER_DOUBLE_VEC3 0
+#endif
+
+#ifndef TRAYRACER_SIMD_VEC3
+#define TRAYRACER_SIMD_VEC3 0
+#endif
+
+#if TRAYRACER_SIMD_VEC3 && !TRAYRACER_DOUBLE_VEC3
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#include <xmmintrin.h>
+#define TRAYRACER_VEC3_SSE 1
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define TRAYRACER_VEC3_NEON 1
+#endif
+#endif
+
+#ifndef TRAYRACER_VEC3_SSE
+#define TRAYRACER_VEC3_SSE 0
+#endif
+#ifndef TRAYRACER_VEC3_NEON
+#define TRAYRACER_VEC3_NEON 0
+#endif
+#define TRAYRACER_VEC3_SIMD (TRAYRACER_VEC3_SSE || TRAYRACER_VEC3_NEON)
+
 #define MPI 3.14159265358979323846
 
-class vec3
+#if TRAYRACER_VEC3_SIMD
+// ONE 16 BYTE REGISTER, w IS PADDING THE OPS CARRY ALONG AND NOTHING READS
+#define TRAYRACER_VEC3_ALIGN alignas(16)
+#else
+#define TRAYRACER_VEC3_ALIGN
+#endif
+
+class TRAYRACER_VEC3_ALIGN vec3
 {
 public:
-    double x, y, z;
-
-    vec3(float a) : vec3(a, a, a) {};
+#if TRAYRACER_DOUBLE_VEC3
+    typedef double Scalar;
+#else
+    typedef float Scalar;
+#endif
+
+    Scalar x, y, z;
+#if TRAYRACER_VEC3_SIMD
+    Scalar w = 0;
+#endif
+
+    vec3(Scalar a) : vec3(a, a, a) {};
     vec3() : x(0), y(0), z(0) {}
-    vec3(double x, double y, double z) : x(x), y(y), z(z) {}
-
-
-    vec3(std::initializer_list<double> const il)
-    {
-        assert(il.size() == 3);
-
-        int i = 0;
-        for (auto v : il)
-        {
-            double* d = reinterpret_cast<double*>(this);
-            d += i;
-            *d = v;
-            i++;
-        }
-    }
-
-
-    ~vec3()
-    {
-    }
-
-    vec3(vec3 const& rhs)
+    vec3(Scalar x, Scalar y, Scalar z) : x(x), y(y), z(z) {}
+
+#if TRAYRACER_VEC3_SSE
+    explicit vec3(__m128 v) { _mm_store_ps(&x, v); }
+    __m128 Load() const { return _mm_load_ps(&x); }
+
+    vec3 operator+(vec3 const& rhs) const { return vec3(_mm_add_ps(Load(), rhs.Load())); }
+    vec3 operator-(vec3 const& rhs) const { return vec3(_mm_sub_ps(Load(), rhs.Load())); }
+    vec3 operator-() const { return vec3(_mm_sub_ps(_mm_setzero_ps(), Load())); }
+    vec3 operator*(Scalar const c) const { return vec3(_mm_mul_ps(Load(), _mm_set1_ps(c))); }
+#elif TRAYRACER_VEC3_NEON
+    explicit vec3(float32x4_t v) { vst1q_f32(&x, v); }
+    float32x4_t Load() const { return vld1q_f32(&x); }
+
+    vec3 operator+(vec3 const& rhs) const { return vec3(vaddq_f32(Load(), rhs.Load())); }
+    vec3 operator-(vec3 const& rhs) const { return vec3(vsubq_f32(Load(), rhs.Load())); }
+    vec3 operator-() const { return vec3(vnegq_f32(Load())); }
+    vec3 operator*(Scalar const c) const { return vec3(vmulq_n_f32(Load(), c)); }
+#else
+    vec3 operator+(vec3 const& rhs) const { return {x + rhs.x, y + rhs.y, z + rhs.z};}
+    vec3 operator-(vec3 const& rhs) const { return {x - rhs.x, y - rhs.y, z - rhs.z};}
+    vec3 operator-() const { return {-x, -y, -z};}
+    vec3 operator*(Scalar const c) const { return {x * c, y * c, z * c};}
+#endif
+    // MULTIPLY BY THE INVERSE, ONE DIVIDE INSTEAD OF THREE
+    vec3 operator/(Scalar const c) const
     {
-        this->x = rhs.x;
-        this->y = rhs.y;
-        this->z = rhs.z;
-
+        Scalar inv = Scalar(1) / c;
+        return vec3(x * inv, y * inv, z * inv);
     }
 
-    vec3 operator+(vec3 const& rhs) { return {x + rhs.x, y + rhs.y, z + rhs.z};}
-    vec3 operator-(vec3 const& rhs) { return {x - rhs.x, y - rhs.y, z - rhs.z};}
-    vec3 operator-() { return {-x, -y, -z};}
-    vec3 operator*(float const c) { return {x * c, y * c, z * c};}
-    vec3 operator/(double const c) const { return vec3(x / c, y / c, z / c); }
-
-    double& operator[](const int i)
+    Scalar& operator[](const int i)
     {
-        if (i == 0)
-            return x;
-        else if (i == 1)
-            return y;
-        else if (i == 2)
-            return z;
-        else
-            assert(false && "Out of bound");
+        assert(i >= 0 && i < 3 && "Out of bound");
+        return (&x)[i];
     }
-    double const& operator[](const int i) const
+    Scalar const& operator[](const int i) const
     {
-        if (i == 0)
-            return x;
-        else if (i == 1)
-            return y;
-        else if (i == 2)
-            return z;
-        else
-            assert(false && "Out of bound");
+        assert(i >= 0 && i < 3 && "Out of bound");
+        return (&x)[i];
     }
 
 };
 
 // Get length of 3D vector
-inline double len(vec3 const& v)
+inline vec3::Scalar len(vec3 const& v)
 {
-
-    return float(sqrt(v.x * v.x + v.y * v.y + v.z * v.z));
+    return std::sqrt(v.x * v.x + v.y * v.y + v.z * v.z);
 }
 
 // Get normalized version of v
 inline vec3 normalize(vec3 v)
 {
-    double l = len(v);
+    vec3::Scalar l = len(v);
     if (l == 0)
         return vec3(0,0,0);
 
-    vec3 ret = vec3(v.x / l, v.y / l, v.z / l);
-    return vec3(ret);
-
-    return vec3(v.x / l, v.y / l, v.z / l);
+    vec3::Scalar inv = vec3::Scalar(1) / l;
+    return vec3(v.x * inv, v.y * inv, v.z * inv);
 }
 
 inline vec3 min(const vec3& a, const vec3& b) {
+#if TRAYRACER_VEC3_SSE
+    return vec3(_mm_min_ps(a.Load(), b.Load()));
+#elif TRAYRACER_VEC3_NEON
+    return vec3(vminq_f32(a.Load(), b.Load()));
+#else
     return vec3(
         a.x < b.x ? a.x : b.x,
         a.y < b.y ? a.y : b.y,
         a.z < b.z ? a.z : b.z
     );
+#endif
 }
 
 inline vec3 max(const vec3& a, const vec3& b) {
+#if TRAYRACER_VEC3_SSE
+    return vec3(_mm_max_ps(a.Load(), b.Load()));
+#elif TRAYRACER_VEC3_NEON
+    return vec3(vmaxq_f32(a.Load(), b.Load()));
+#else
     return vec3(
         a.x > b.x ? a.x : b.x,
         a.y > b.y ? a.y : b.y,
         a.z > b.z ? a.z : b.z
     );
+#endif
 }
 
 inline int max(const int& a, const int& b) {
@@ -116,23 +155,29 @@ inline int max(const int& a, const int& b) {
 // piecewise multiplication between two vectors
 inline vec3 mul(vec3 a, vec3 b)
 {
+#if TRAYRACER_VEC3_SSE
+    return vec3(_mm_mul_ps(a.Load(), b.Load()));
+#elif TRAYRACER_VEC3_NEON
+    return vec3(vmulq_f32(a.Load(), b.Load()));
+#else
     return {a.x * b.x, a.y * b.y, a.z * b.z};
+#endif
 }
 
 // piecewise add between two vectors
 inline vec3 add(vec3 a, vec3 b)
 {
-    return {a.x + b.x, a.y + b.y, a.z + b.z};
+    return a + b;
 }
 
-inline float dot(vec3 a, vec3 b)
+inline vec3::Scalar dot(vec3 a, vec3 b)
 {
     return a.x * b.x + a.y * b.y + a.z * b.z;
 }
 
 inline vec3 reflect(vec3 v, vec3 n)
 {
-    return v - n * (2 * dot(v,n));
+    return v - n * (vec3::Scalar(2) * dot(v,n));
 }
 
 inline vec3 cross(vec3 a, vec3 b)
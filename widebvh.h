@@ -0,0 +1,269 @@
+#pragma once
+#include "bvh.h"
+#include <vector>
+#include <float.h>
+
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#define TRAYRACER_SSE 1
+#include <xmmintrin.h>
+#endif
+#if defined(__AVX__)
+#define TRAYRACER_AVX 1
+#include <immintrin.h>
+#elif (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+// NOT BUILT FOR AVX, COMPILE THE 8-WIDE TEST FOR IT ANYWAY AND PICK IT AT RUNTIME
+#define TRAYRACER_AVX 1
+#define TRAYRACER_AVX_DISPATCH 1
+#include <immintrin.h>
+#endif
+
+#ifdef TRAYRACER_AVX_DISPATCH
+#define TRAYRACER_AVX_TARGET __attribute__((target("avx")))
+inline bool
+DetectAVX()
+{
+	// STATIC INITIALIZERS MAY RUN BEFORE LIBGCC HAS LOOKED AT THE CPU
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx");
+}
+inline const bool bCPUHasAVX = DetectAVX();
+#else
+#define TRAYRACER_AVX_TARGET
+#endif
+
+// true when 8-wide traversal tests its children with AVX, false when it falls back on scalar code
+inline bool
+WideBVHUsesAVX()
+{
+#if defined(TRAYRACER_AVX_DISPATCH)
+	return bCPUHasAVX;
+#elif defined(TRAYRACER_AVX)
+	return true;
+#else
+	return false;
+#endif
+}
+
+
+// Node of an N-wide BVH, child bounds are stored per axis (SoA) so one
+// SIMD slab test covers every child at once
+template<int N>
+struct alignas(32) WideNode
+{
+	float MinX[N], MinY[N], MinZ[N];
+	float MaxX[N], MaxY[N], MaxZ[N];
+	// inner child: index into WideBVH::Nodes
+	// leaf child: index of the first primitive in FlatBVH::Primitives
+	int Child[N];
+	// number of primitives for leaf children, 0 for inner children
+	unsigned Count[N];
+	// number of lanes in use, the lanes after it are masked off in traversal
+	int NumChildren;
+};
+
+// Ray converted once into the form the wide slab tests want
+struct WideRay
+{
+	float Origin[3];
+	float InvDir[3];
+};
+
+
+//------------------------------------------------------------------------------
+/**
+	Tests the ray against every child box of the node, returns a bitmask of
+	the children hit closer than maxDist and writes their entry distances
+*/
+template<int N>
+inline int
+IntersectChildrenScalar(const WideNode<N>& node, const WideRay& ray, float maxDist, float tEntry[N])
+{
+	int Mask = 0;
+	for (int i = 0; i < N; i++) {
+		float tx0 = (node.MinX[i] - ray.Origin[0]) * ray.InvDir[0];
+		float tx1 = (node.MaxX[i] - ray.Origin[0]) * ray.InvDir[0];
+		float ty0 = (node.MinY[i] - ray.Origin[1]) * ray.InvDir[1];
+		float ty1 = (node.MaxY[i] - ray.Origin[1]) * ray.InvDir[1];
+		float tz0 = (node.MinZ[i] - ray.Origin[2]) * ray.InvDir[2];
+		float tz1 = (node.MaxZ[i] - ray.Origin[2]) * ray.InvDir[2];
+		float tMin = std::max(std::max(std::max(std::min(tx0, tx1), std::min(ty0, ty1)), std::min(tz0, tz1)), 0.0f);
+		float tMax = std::min(std::min(std::min(std::max(tx0, tx1), std::max(ty0, ty1)), std::max(tz0, tz1)), maxDist);
+		tEntry[i] = tMin;
+		if (tMin <= tMax)
+			Mask |= 1 << i;
+	}
+	return Mask;
+}
+
+template<int N>
+inline int
+IntersectChildren(const WideNode<N>& node, const WideRay& ray, float maxDist, float tEntry[N])
+{
+	return IntersectChildrenScalar(node, ray, maxDist, tEntry);
+}
+
+#ifdef TRAYRACER_SSE
+template<>
+inline int
+IntersectChildren<4>(const WideNode<4>& node, const WideRay& ray, float maxDist, float tEntry[4])
+{
+	const __m128 ox = _mm_set1_ps(ray.Origin[0]);
+	const __m128 oy = _mm_set1_ps(ray.Origin[1]);
+	const __m128 oz = _mm_set1_ps(ray.Origin[2]);
+	const __m128 ix = _mm_set1_ps(ray.InvDir[0]);
+	const __m128 iy = _mm_set1_ps(ray.InvDir[1]);
+	const __m128 iz = _mm_set1_ps(ray.InvDir[2]);
+
+	__m128 tx0 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.MinX), ox), ix);
+	__m128 tx1 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.MaxX), ox), ix);
+	__m128 ty0 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.MinY), oy), iy);
+	__m128 ty1 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.MaxY), oy), iy);
+	__m128 tz0 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.MinZ), oz), iz);
+	__m128 tz1 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.MaxZ), oz), iz);
+
+	__m128 tMin = _mm_max_ps(_mm_max_ps(_mm_min_ps(tx0, tx1), _mm_min_ps(ty0, ty1)), _mm_min_ps(tz0, tz1));
+	__m128 tMax = _mm_min_ps(_mm_min_ps(_mm_max_ps(tx0, tx1), _mm_max_ps(ty0, ty1)), _mm_max_ps(tz0, tz1));
+	tMin = _mm_max_ps(tMin, _mm_setzero_ps());
+	tMax = _mm_min_ps(tMax, _mm_set1_ps(maxDist));
+
+	_mm_storeu_ps(tEntry, tMin);
+	return _mm_movemask_ps(_mm_cmple_ps(tMin, tMax));
+}
+#endif
+
+#ifdef TRAYRACER_AVX
+TRAYRACER_AVX_TARGET inline int
+IntersectChildrenAVX(const WideNode<8>& node, const WideRay& ray, float maxDist, float tEntry[8])
+{
+	const __m256 ox = _mm256_set1_ps(ray.Origin[0]);
+	const __m256 oy = _mm256_set1_ps(ray.Origin[1]);
+	const __m256 oz = _mm256_set1_ps(ray.Origin[2]);
+	const __m256 ix = _mm256_set1_ps(ray.InvDir[0]);
+	const __m256 iy = _mm256_set1_ps(ray.InvDir[1]);
+	const __m256 iz = _mm256_set1_ps(ray.InvDir[2]);
+
+	__m256 tx0 = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.MinX), ox), ix);
+	__m256 tx1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.MaxX), ox), ix);
+	__m256 ty0 = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.MinY), oy), iy);
+	__m256 ty1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.MaxY), oy), iy);
+	__m256 tz0 = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.MinZ), oz), iz);
+	__m256 tz1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.MaxZ), oz), iz);
+
+	__m256 tMin = _mm256_max_ps(_mm256_max_ps(_mm256_min_ps(tx0, tx1), _mm256_min_ps(ty0, ty1)), _mm256_min_ps(tz0, tz1));
+	__m256 tMax = _mm256_min_ps(_mm256_min_ps(_mm256_max_ps(tx0, tx1), _mm256_max_ps(ty0, ty1)), _mm256_max_ps(tz0, tz1));
+	tMin = _mm256_max_ps(tMin, _mm256_setzero_ps());
+	tMax = _mm256_min_ps(tMax, _mm256_set1_ps(maxDist));
+
+	_mm256_storeu_ps(tEntry, tMin);
+	return _mm256_movemask_ps(_mm256_cmp_ps(tMin, tMax, _CMP_LE_OQ));
+}
+
+template<>
+inline int
+IntersectChildren<8>(const WideNode<8>& node, const WideRay& ray, float maxDist, float tEntry[8])
+{
+#ifdef TRAYRACER_AVX_DISPATCH
+	if (!bCPUHasAVX)
+		return IntersectChildrenScalar(node, ray, maxDist, tEntry);
+#endif
+	return IntersectChildrenAVX(node, ray, maxDist, tEntry);
+}
+#endif
+
+
+// N-wide BVH collapsed from the binary FlatBVH, shares its primitive array
+template<int N>
+class WideBVH
+{
+public:
+	std::vector<WideNode<N>> Nodes;
+
+	void Collapse(const FlatBVH& flat) {
+		Nodes.clear();
+		if (flat.Empty())
+			return;
+
+		// A LEAF ROOT STILL NEEDS A WIDE NODE TO HANG FROM
+		if (flat.Nodes[0].IsLeaf()) {
+			Nodes.emplace_back();
+			InitNode(Nodes[0]);
+			SetChild(Nodes[0], 0, flat.Nodes[0], flat.Nodes[0].Offset);
+			return;
+		}
+		CollapseNode(flat, 0);
+	}
+
+	bool Empty() const {
+		return Nodes.empty();
+	}
+
+private:
+	static void InitNode(WideNode<N>& node) {
+		for (int i = 0; i < N; i++) {
+			node.MinX[i] = node.MinY[i] = node.MinZ[i] = FLT_MAX;
+			node.MaxX[i] = node.MaxY[i] = node.MaxZ[i] = -FLT_MAX;
+			node.Child[i] = 0;
+			node.Count[i] = 0;
+		}
+		node.NumChildren = 0;
+	}
+
+	static void SetChild(WideNode<N>& node, int lane, const FlatNode& child, int index) {
+		node.MinX[lane] = child.Min[0];
+		node.MinY[lane] = child.Min[1];
+		node.MinZ[lane] = child.Min[2];
+		node.MaxX[lane] = child.Max[0];
+		node.MaxY[lane] = child.Max[1];
+		node.MaxZ[lane] = child.Max[2];
+		node.Child[lane] = index;
+		node.Count[lane] = child.Count;
+		node.NumChildren = std::max(node.NumChildren, lane + 1);
+	}
+
+	static float SurfaceArea(const FlatNode& node) {
+		float x = node.Max[0] - node.Min[0];
+		float y = node.Max[1] - node.Min[1];
+		float z = node.Max[2] - node.Min[2];
+		return 2 * (x * y + x * z + y * z);
+	}
+
+	// Pulls grandchildren of the binary inner node up into one wide node,
+	// always opening the largest inner child first, returns its index
+	int CollapseNode(const FlatBVH& flat, int binaryIndex) {
+		int Index = (int)Nodes.size();
+		Nodes.emplace_back();
+
+		const FlatNode& root = flat.Nodes[binaryIndex];
+		int Children[N];
+		int NumChildren = 2;
+		Children[0] = binaryIndex + 1;
+		Children[1] = root.Offset;
+
+		while (NumChildren < N) {
+			int Best = -1;
+			float BestArea = -1.0f;
+			for (int i = 0; i < NumChildren; i++) {
+				const FlatNode& child = flat.Nodes[Children[i]];
+				if (!child.IsLeaf() && SurfaceArea(child) > BestArea) {
+					BestArea = SurfaceArea(child);
+					Best = i;
+				}
+			}
+			if (Best < 0)
+				break;
+			int Opened = Children[Best];
+			Children[Best] = Opened + 1;
+			Children[NumChildren++] = flat.Nodes[Opened].Offset;
+		}
+
+		WideNode<N> node;
+		InitNode(node);
+		for (int i = 0; i < NumChildren; i++) {
+			const FlatNode& child = flat.Nodes[Children[i]];
+			int ChildIndex = child.IsLeaf() ? child.Offset : CollapseNode(flat, Children[i]);
+			SetChild(node, i, child, ChildIndex);
+		}
+		Nodes[Index] = node;
+		return Index;
+	}
+};
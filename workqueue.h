@@ -0,0 +1,172 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+//------------------------------------------------------------------------------
+/**
+	Chase-Lev work stealing deque, with the memory orderings of Le et al.,
+	"Correct and Efficient Work-Stealing for Weak Memory Models".
+
+	The owning thread pushes and pops at the bottom without any atomic read
+	modify write unless the deque is down to one item, other threads steal
+	from the top with one compare exchange. T has to be trivially copyable,
+	the pool stores task pointers in it.
+*/
+template <typename T>
+class WorkStealingDeque
+{
+public:
+	explicit WorkStealingDeque(int64_t capacity = 256)
+	{
+		Retired.emplace_back(new Array(capacity));
+		Buffer.store(Retired.back().get(), std::memory_order_relaxed);
+	}
+
+	WorkStealingDeque(const WorkStealingDeque&) = delete;
+	WorkStealingDeque& operator=(const WorkStealingDeque&) = delete;
+
+	/// owner only
+	void Push(T item)
+	{
+		int64_t b = Bottom.load(std::memory_order_relaxed);
+		int64_t t = Top.load(std::memory_order_acquire);
+		Array* a = Buffer.load(std::memory_order_relaxed);
+		if (b - t > a->Capacity - 1)
+			a = Grow(a, t, b);
+		a->Put(b, item);
+		std::atomic_thread_fence(std::memory_order_release);
+		Bottom.store(b + 1, std::memory_order_relaxed);
+	}
+
+	/// owner only, takes the newest item
+	bool Pop(T& item)
+	{
+		int64_t b = Bottom.load(std::memory_order_relaxed) - 1;
+		Array* a = Buffer.load(std::memory_order_relaxed);
+		Bottom.store(b, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		int64_t t = Top.load(std::memory_order_relaxed);
+		if (t > b) {
+			Bottom.store(b + 1, std::memory_order_relaxed);
+			return false;
+		}
+
+		item = a->Get(b);
+		if (t == b) {
+			// LAST ITEM, RACE THE THIEVES FOR IT
+			bool won = Top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed);
+			Bottom.store(b + 1, std::memory_order_relaxed);
+			return won;
+		}
+		return true;
+	}
+
+	/// any thread, takes the oldest item. Only fails when the deque is empty,
+	/// losing a race to another thief retries
+	bool Steal(T& item)
+	{
+		while (true) {
+			int64_t t = Top.load(std::memory_order_acquire);
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			int64_t b = Bottom.load(std::memory_order_acquire);
+			if (t >= b)
+				return false;
+
+			Array* a = Buffer.load(std::memory_order_acquire);
+			item = a->Get(t);
+			if (Top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+				return true;
+		}
+	}
+
+	/// may be stale by the time it returns
+	bool Empty() const
+	{
+		return Top.load(std::memory_order_relaxed) >= Bottom.load(std::memory_order_relaxed);
+	}
+
+private:
+	struct Array
+	{
+		int64_t Capacity;
+		std::unique_ptr<std::atomic<T>[]> Items;
+
+		explicit Array(int64_t capacity) : Capacity(capacity), Items(new std::atomic<T>[capacity]) {}
+		T Get(int64_t i) const { return Items[i & (Capacity - 1)].load(std::memory_order_relaxed); }
+		void Put(int64_t i, T item) { Items[i & (Capacity - 1)].store(item, std::memory_order_relaxed); }
+	};
+
+	Array* Grow(Array* a, int64_t t, int64_t b)
+	{
+		Retired.emplace_back(new Array(a->Capacity * 2));
+		Array* grown = Retired.back().get();
+		for (int64_t i = t; i < b; i++)
+			grown->Put(i, a->Get(i));
+		Buffer.store(grown, std::memory_order_release);
+		return grown;
+	}
+
+	// KEEP THE TOP AND BOTTOM ON LINES OF THEIR OWN, THIEVES HAMMER THE TOP
+	alignas(64) std::atomic<int64_t> Top{ 0 };
+	alignas(64) std::atomic<int64_t> Bottom{ 0 };
+	std::atomic<Array*> Buffer{ nullptr };
+	// A THIEF MAY STILL READ AN OLD ARRAY, SO THEY ARE ONLY FREED WITH THE DEQUE
+	std::vector<std::unique_ptr<Array>> Retired;
+};
+
+//------------------------------------------------------------------------------
+/**
+	Single use countdown, like C++20 std::latch. Counting down is one atomic
+	decrement, only the last one takes the lock to wake the waiter
+*/
+class Latch
+{
+public:
+	explicit Latch(int count) : Count(count) {}
+
+	Latch(const Latch&) = delete;
+	Latch& operator=(const Latch&) = delete;
+
+	void CountDown()
+	{
+		// ACQUIRE TOO, THE LAST ONE PASSES EVERY EARLIER TASK'S WRITES ON TO THE WAITER
+		int old = Count.load(std::memory_order_acquire);
+		while (old > 1) {
+			if (Count.compare_exchange_weak(old, old - 1, std::memory_order_acq_rel, std::memory_order_acquire))
+				return;
+		}
+		// THE LAST ONE STORES UNDER THE LOCK, SO Wait CAN'T RETURN AND FREE THE LATCH UNDER IT
+		std::unique_lock<std::mutex> lock(WaitMutex);
+		Count.store(0, std::memory_order_release);
+		Done.notify_all();
+	}
+
+	/// true once the count is zero. Call Wait before freeing the latch
+	bool TryWait() const
+	{
+		return Count.load(std::memory_order_acquire) == 0;
+	}
+
+	void Wait()
+	{
+		std::unique_lock<std::mutex> lock(WaitMutex);
+		Done.wait(lock, [this] { return TryWait(); });
+	}
+
+private:
+	std::atomic<int> Count;
+	std::mutex WaitMutex;
+	std::condition_variable Done;
+};
+
+// one task of a RunTasks batch, it lives on the stack of RunTasks until the batch is done
+struct PoolTask
+{
+	std::function<void()>* Func;
+	Latch* Done;
+};